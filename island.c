@@ -27,18 +27,161 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <time.h>
+#include <math.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
-#define FRAME_RATE (10)
-#define FRAME_DELAY (1000000/FRAME_RATE)
-#define GRAVITY  (9.8/FRAME_RATE)
-#define WATER_TENSION   0.025
-#define WATER_DAMPENING 0.025
-#define WATER_SPREAD    0.25
-#define CLOUD_SPEED     (10.0 / FRAME_RATE)
-#define DRIP_RATE       10
+//Frame rate, gravity, water and cloud tuning live in params_t (-f FILE)
+#define PARAMS_FILE_MAX 4096
+//Spread passes stop once no delta exceeds WATER_CONVERGED, and the water
+//is left alone once no column moves or sits off target by WATER_IDLE
+#define WATER_PASSES    8
+#define WATER_CONVERGED 0.0001
+#define WATER_IDLE      0.001
+//Disturbed column spans tracked at once before neighbors are merged
+#define WATER_SPANS     16
+
+//Fixed point physics (-x) is Q16.16 unless built with another FIX_SHIFT.
+//Right shifts of negative values are assumed to be arithmetic.
+#ifndef FIX_SHIFT
+#define FIX_SHIFT 16
+#endif
+#define FIX_ONE       ((fix_t)1<<FIX_SHIFT)
+#define FIX(v)        ((fix_t)((v)*FIX_ONE + ((v) < 0 ? -0.5 : 0.5)))
+#define FIX_MUL(a,b)  ((fix_t)(((int64_t)(a)*(b)) >> FIX_SHIFT))
+#define FIX_FLOAT(a)  ((float)(a)/FIX_ONE)
+#define FIX_INT(a)    ((a) >> FIX_SHIFT)
+
+//2D wave solver: substeps per frame, damping per substep, SIMD width and tiles
+#define WAVE_STEPS      4
+#define WAVE_DAMPING    0.985f
+#define WAVE_VEC        8
+#define WAVE_TILE_X     256
+#define WAVE_TILE_Z     16
+#define LIGHTNING_SECONDS 8  //Mean time between flashes
+//After this many wakeups without drawing, the frame loop sleeps twice as
+//long and catches up on the simulation steps it slept through
+#define IDLE_WAKEUPS    2
+#define IDLE_STEPS_MAX  8
+#define DAY_LENGTH      600
+#define DAY_COLOR_MASK  0xf8f8f8
+
+//Worst case output bytes per cell (cursor move + SGR + glyph) and per frame
+#define ENCODE_CELL_MAX 64
+#define ENCODE_SLACK    2048
+#define SYNC_BEGIN      "\x1b[?2026h"
+#define SYNC_END        "\x1b[?2026l"
+//Runs of blank cells at least this long are erased with ECH instead of spaces
+#define ECH_MIN         8
+//Bandwidth governor levels: 256 colors at most, 16 colors, two water
+//levels per cell, ASCII glyphs.  A level is added after a second in which
+//more than 1 in GOVERNOR_DROP frames had to wait for the budget.
+#define GOVERNOR_LEVELS 5
+#define GOVERNOR_DROP   4
+//Seconds with room to spare before a feature comes back
+#define GOVERNOR_CALM   5
+//Seconds of budget the bucket holds, so a burst such as a lightning flash
+//is paid from what calmer frames left over
+#define GOVERNOR_DEPTH  4
+
+//Broadcast server (-L): a viewer stalled this many frames is repainted
+//whole once it drains, and requests longer than VIEW_LINE are refused
+#define VIEWER_RESYNC   20
+#define VIEW_LINE       64
+#define SERVER_EVENTS   64
+//Shared memory frames (-M/-V): a ring of SHM_SLOTS composed worlds after
+//a header of SHM_HEADER bytes.  A reader copying the newest frame is only
+//disturbed if the publisher laps the whole ring meanwhile.
+#define SHM_SLOTS       4
+#define SHM_HEADER      64
+#define SHM_MAGIC       0x69736c31
+//Tries at a slot being written before a viewer waits for the next frame
+#define SHM_RETRIES     1000
+
+//Interactive input: bytes kept of an incomplete escape sequence, how fast
+//a drip clicked under the surface goes down in eighths per frame, and the
+//slowest rain the - key reaches in frames between drops
+#define INPUT_BUF       64
+#define SPLASH_SPEED    -24
+#define RAIN_DELAY_MAX  600
+
+//Capability probe: longest wait for the answers in ms, bytes of answers
+//kept, and the longest cache file path
+#define CAPS_TIMEOUT    200
+#define CAPS_REPLY      512
+#define CAPS_PATH       512
+
+//Headless output (-R): cells of RASTER_CW by RASTER_CH pixels, a direct
+//mapped cache of drawn glyph tiles, and the colors of a terminal default
+#define RASTER_RGB       0
+#define RASTER_Y4M       1
+#define RASTER_CW        8
+#define RASTER_CH        16
+#define RASTER_TILE_BITS 12
+#define RASTER_TILES     (1<<RASTER_TILE_BITS)
+#define RASTER_FG        0xc0c0c0
+#define RASTER_BG        0x000000
+//Default world for -R, 1920x1072 pixels
+#define RASTER_WIDTH     240
+#define RASTER_HEIGHT    67
+
+//Scenes (-e): the largest file, how many sprites, layers, sprite cells
+//and parameters one holds, the longest sprite name, and the most words a
+//line has.  Sprite rows are ASCII.
+#define SCENE_FILE_MAX   16384
+#define SCENE_SPRITES    32
+#define SCENE_LAYERS     64
+#define SCENE_CELLS      8192
+#define SCENE_SPANS      SCENE_CELLS
+#define SCENE_PARAMS     16
+#define SCENE_NAME       16
+#define SCENE_WORDS      8
+#define SCENE_KEYS       128
+#define SCENE_CLOUD      1
+#define SCENE_RAIN       2
+#define SCENE_STORM      4
+#define LAYER_LEFT       0
+#define LAYER_CENTER     1
+#define LAYER_RIGHT      2
+
+//Frame loop stages timed when built with STATS (make STATS=1)
+#define STAGE_TERMSIZE  0
+#define STAGE_SCREEN    1
+#define STAGE_DRIPS     2
+#define STAGE_CLOUD     3
+#define STAGE_WATER     4
+#define STAGE_DAYNIGHT  5
+#define STAGE_STORM     6
+#define STAGE_RENDER    7
+#define STAGE_ENCODE    8
+#define STAGE_FLUSH     9
+#define STAGES          10
+//Histogram bucket b counts times in [2^(b-1),2^b) nanoseconds
+#define STATS_BUCKETS   32
+#ifdef STATS
+#define STAGE(stage,call) do { \
+	uint64_t stage_start = stats_now(); \
+	call; \
+	stats_record(stage,stats_now()-stage_start); \
+} while(0)
+#else
+#define STAGE(stage,call) call
+#endif
 
 char* drip_char = "\u25CF";
 char* fish_chars[2] = {
@@ -67,10 +210,153 @@ char* water_chars[8] = {
 	"\u2587",
 	"\u2588",
 };
+char* ascii_water_chars[8] = {
+	"_",
+	"_",
+	".",
+	".",
+	"-",
+	"~",
+	"=",
+	"#",
+};
 
 uint8_t fgcolors[] = {30, 31, 32, 33, 34, 35, 36, 37,  90,  91,  92,  93,  94,  95,  96,  97};
 uint8_t bgcolors[] = {40, 41, 42, 43, 44, 45, 46, 47, 100, 101, 102, 103, 104, 105, 106, 107};
 
+//Glyph indices stored in the cell buffer
+#define GLYPH_SPACE 0
+#define GLYPH_CLOUD 1
+#define GLYPH_DRIP  2
+#define GLYPH_WATER 3
+#define GLYPH_COUNT (GLYPH_WATER+8)
+//A sprite cell that lets what is under it show
+#define GLYPH_NONE  0xffff
+
+//Glyph sets, the ASCII set is one byte per glyph
+#define GLYPHS_UNICODE 0
+#define GLYPHS_ASCII   1
+#define GLYPH_SETS     2
+
+char*  glyphs[GLYPH_SETS][GLYPH_COUNT];
+size_t glyph_len[GLYPH_SETS][GLYPH_COUNT];
+
+//Bitmap font for the headless output, a byte per row of each glyph
+const uint8_t raster_font[GLYPH_COUNT][RASTER_CH] = {
+	{0},
+	{0x00,0x00,0x7c,0xc6,0xc6,0xde,0xde,0xde,0xdc,0xc0,0x7c,0x00,0x00,0x00,0x00,0x00},
+	{0x00,0x00,0x00,0x00,0x3c,0x7e,0xff,0xff,0xff,0xff,0x7e,0x3c,0x00,0x00,0x00,0x00},
+	{0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xff,0xff},
+	{0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xff,0xff,0xff,0xff},
+	{0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xff,0xff,0xff,0xff,0xff,0xff},
+	{0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff},
+	{0x00,0x00,0x00,0x00,0x00,0x00,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff},
+	{0x00,0x00,0x00,0x00,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff},
+	{0x00,0x00,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff},
+	{0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff,0xff},
+};
+
+//Palette indices stored in the cell buffer
+#define PAL_DEFAULT     0
+#define PAL_BLACK       1
+#define PAL_WATER       2
+#define PAL_GRASS       3
+#define PAL_TRUNK       4
+#define PAL_SAND        5
+#define PAL_CLOUD       6
+#define PAL_FLASH_SKY   7
+#define PAL_FLASH_WATER 8
+#define PAL_FLASH_GRASS 9
+#define PAL_FLASH_TRUNK 10
+#define PAL_FLASH_SAND  11
+#define PAL_DEPTH       16
+#define DEPTH_BANDS     8
+#define PAL_SKY         32
+#define SKY_BANDS       16
+#define PAL_SIZE        256
+
+//Palette entries are 0xRRGGBB or COLOR_DEFAULT.  Resolved colors are 
+//0xRRGGBB (truecolor), a color number (256 and 16 color) or one of these.
+#define COLOR_DEFAULT 0x01000000
+#define COLOR_ANY     0x02000000
+
+#define COLORS_16   0
+#define COLORS_256  1
+#define COLORS_TRUE 2
+
+//Reference RGB for the 16 ANSI colors (xterm defaults)
+uint32_t ansi_rgb[16] = {
+	0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+	0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff,
+};
+uint8_t cube_levels[6] = {0x00, 0x5f, 0x87, 0xaf, 0xd7, 0xff};
+
+//Sky top, sky horizon, water surface and deep water at midnight, dawn,
+//noon, dusk and midnight again
+#define DAY_KEYS 5
+uint32_t day_keys[DAY_KEYS][4] = {
+	{0x000010, 0x101830, 0x000840, 0x000010},
+	{0x203060, 0xf08040, 0x204080, 0x001030},
+	{0x2060c0, 0x90c0f0, 0x0000ee, 0x00008c},
+	{0x302050, 0xff6030, 0x203070, 0x000830},
+	{0x000010, 0x101830, 0x000840, 0x000010},
+};
+
+//RGB555 to color number lookups, built once by colors_init()
+#define RGB15(c) ((((c)>>9)&0x7c00) | (((c)>>6)&0x03e0) | (((c)>>3)&0x001f))
+uint8_t quant16[32768];
+uint8_t quant256[32768];
+
+typedef int32_t fix_t;
+
+//Tuning knobs.  Rates are given per second and converted to per frame when
+//loaded, along with fixed point copies for the -x physics.
+typedef struct {
+	double frame_rate;
+	double gravity;
+	double cloud_speed;
+	double drip_interval;    //Seconds between drops from the cloud
+	double water_tension;
+	double water_dampening;
+	double water_spread;
+	double water_level;      //Initial water height in eighths
+	size_t frame_delay;      //Microseconds
+	double frame_gravity;
+	double frame_cloud_speed;
+	size_t drip_delay;       //Frames
+	size_t flash_odds;       //One in this many frames starts a flash
+	fix_t  fix_gravity;
+	fix_t  fix_cloud_speed;
+	fix_t  fix_tension;
+	fix_t  fix_dampening;
+	fix_t  fix_spread;
+	fix_t  fix_level;
+} params_t;
+
+typedef struct {
+	const char *name;
+	size_t offset;
+} param_key_t;
+
+param_key_t param_keys[] = {
+	{"frame_rate",      offsetof(params_t,frame_rate)},
+	{"gravity",         offsetof(params_t,gravity)},
+	{"cloud_speed",     offsetof(params_t,cloud_speed)},
+	{"drip_interval",   offsetof(params_t,drip_interval)},
+	{"water_tension",   offsetof(params_t,water_tension)},
+	{"water_dampening", offsetof(params_t,water_dampening)},
+	{"water_spread",    offsetof(params_t,water_spread)},
+	{"water_level",     offsetof(params_t,water_level)},
+};
+#define PARAM_KEYS (sizeof(param_keys)/sizeof(param_keys[0]))
+
+//The frame loop reads whichever slot params points at.  A reload fills the
+//other slot and swaps the pointer, so nothing is allocated and a frame
+//never sees half a reload.
+params_t params_slots[2];
+params_t *params = &params_slots[0];
+volatile sig_atomic_t params_reload = 0;
+
 typedef struct {
 	size_t width;
 	size_t height;
@@ -79,23 +365,36 @@ typedef struct {
 
 typedef struct {
 	uint8_t active;
+	uint8_t landed;   //Hit the water in this frame's collision pass
 	size_t x;
 	size_t y;
 	float speed;
+	fix_t fix_y;
+	fix_t fix_speed;
 } drip_t;
 
 typedef struct {
 	drip_t *drips;
 	size_t size;
 	termsize_t *term;
+	size_t width;     //Size the drips are placed for
+	size_t height;
+	uint8_t fixed;
+	uint8_t updated;  //A drip changed rows, landed or was generated
 } drips_t;
 
 typedef struct {
 	termsize_t *term;
 	float pos;
 	float speed;
-	size_t drop_delay;
+	size_t drop_delay;  //Frames between drops, 0 follows params
 	size_t drop_count;
+	uint8_t fixed;
+	fix_t fix_pos;
+	fix_t fix_speed;
+	size_t cell;      //Column the cloud is drawn from
+	uint8_t updated;  //Moved to another column
+	size_t width;     //World width the position is for
 } cloud_t;
 
 typedef struct {
@@ -105,13 +404,526 @@ typedef struct {
 	float rdelta;
 } water_column_t;
 
+typedef struct {
+	size_t lo;
+	size_t hi;  //Inclusive
+} water_span_t;
+
+typedef float wave_vec_t __attribute__((vector_size(WAVE_VEC*sizeof(float))));
+
+typedef struct {
+	size_t nx;       //Columns, matching the water columns
+	size_t nz;       //Rows into the screen, 0 disables the solver
+	size_t stride;   //Row length including the one cell halo on each side
+	float *cur;      //Inside the water's block, as are prev and mask
+	float *prev;
+	float *mask;     //0 inside the island, 1 in open water
+	size_t island_rx;
+	size_t island_x;
+} wave2d_t;
+
 typedef struct {
 	termsize_t *term;
+	size_t width;      //Size the columns are laid out for
+	size_t height;
+	wave2d_t wave;
 	water_column_t *cols;
+	int32_t *surface;  //Column heights in whole eighths, from water_shade()
+	float   *splash;   //Drip impulses summed per column, zero between frames
+	fix_t   *fix_splash;
 	float  target_height;
 	size_t island_y;
+	uint8_t idle;      //Surface at rest, physics skipped until an impulse
+	uint8_t impulse;   //Set by anything that disturbs the surface
+	uint8_t updated;   //The physics ran this frame
+	size_t  spread_passes;
+	size_t  idle_frames;
+	//Disturbed spans, sorted and disjoint.  Columns outside them are at rest
+	//on the target, which rest_height tracks so they can follow it up.
+	water_span_t spans[WATER_SPANS];
+	size_t  span_count;
+	size_t  span_columns;  //Columns simulated, summed over frames
+	float   rest_height;
+	fix_t   fix_rest;
+	//Fixed point state, the float columns are only a view of it when fixed
+	uint8_t fixed;
+	fix_t *fix_height;
+	fix_t *fix_speed;
+	fix_t *fix_delta;
+	fix_t  fix_target;
 } water_t;
 
+typedef struct {
+	uint16_t glyph;
+	uint8_t  fg;
+	uint8_t  bg;
+} cell_t;
+
+typedef struct {
+	uint32_t glyph;
+	uint32_t fg;
+	uint32_t bg;
+} shown_t;
+
+typedef struct {
+	char     name[SCENE_NAME];
+	uint16_t width;
+	uint16_t height;
+	uint32_t offset;  //First of its cells in scene->cells, row by row
+	uint32_t span;    //First of its spans in scene->spans
+	uint32_t spans;
+} sprite_t;
+
+//Cells of a sprite row drawn together, the clear cells around them
+//skipped.  A solid span has its own background and is copied whole, the
+//others keep the background under them.
+typedef struct {
+	uint16_t x;
+	uint16_t y;
+	uint16_t len;
+	uint8_t  solid;
+} span_t;
+
+//A sprite standing on the backdrop, x columns right of its place at the
+//anchor and y rows up from the bottom row
+typedef struct {
+	uint8_t sprite;
+	uint8_t anchor;
+	int32_t x;
+	int32_t y;
+} layer_t;
+
+//A scene compiled for the renderer.  Sprite cells are kept in one array,
+//and the layers are composed into a backdrop cell per world cell whenever
+//the world changes size.
+typedef struct {
+	sprite_t sprites[SCENE_SPRITES];
+	size_t   sprite_count;
+	layer_t  layers[SCENE_LAYERS];
+	size_t   layer_count;
+	cell_t   cells[SCENE_CELLS];
+	size_t   cell_count;
+	span_t   spans[SCENE_SPANS];
+	size_t   span_count;
+	cell_t   keys[SCENE_KEYS];  //What each character of a sprite row draws
+	uint32_t colors[PAL_FLASH_SKY];  //COLOR_ANY keeps the built-in color
+	uint8_t  param_keys[SCENE_PARAMS];
+	double   param_values[SCENE_PARAMS];
+	size_t   param_count;
+	uint8_t  cloud;    //Sprite drawn as the cloud
+	uint8_t  island;   //The built-in island is under the layers
+	uint8_t  systems;
+	double   day;      //Seconds, 0 for none
+	cell_t  *backdrop;
+	size_t   backdrop_width;
+	size_t   backdrop_height;
+	size_t   line;     //Where a load stopped
+} scene_t;
+
+const char *scene_colors[PAL_FLASH_SKY] = {"sky","black","water","grass","trunk","sand","cloud"};
+const char *scene_glyphs[GLYPH_WATER] = {"space","cloud","drip"};
+const char *scene_systems[3] = {"cloud","rain","storm"};
+const char *layer_anchors[3] = {"left","center","right"};
+
+//The scene being drawn, the built-in one unless -e loads another
+scene_t scene;
+
+typedef struct {
+	uint32_t rgb[PAL_SIZE];
+	uint8_t  flash[PAL_SIZE];  //Lightning swaps each index for its lit counterpart
+} palette_t;
+
+typedef struct {
+	char  *data;
+	size_t len;
+	size_t size;
+} outbuf_t;
+
+typedef struct {
+	termsize_t *term;
+	palette_t  *palette;
+	size_t   width;
+	size_t   height;
+	cell_t  *cells;   //Composed frame (palette indices)
+	cell_t  *prev;    //Composed frame as of the last encode
+	shown_t *shown;   //What the terminal displays (resolved colors)
+	uint8_t *dirty;   //Rows to diff even if their cells are unchanged
+	outbuf_t out;
+	size_t   cur_x;
+	size_t   cur_y;
+	uint32_t pen_fg;
+	uint32_t pen_bg;
+	uint8_t  invalid;
+	uint8_t  color_mode;
+	uint8_t  glyph_set;
+	uint8_t  coarse;  //Water drawn in half cell steps
+	ptrdiff_t view_x; //World cell drawn in the top left corner
+	ptrdiff_t view_y;
+	ptrdiff_t shown_view_x;  //View the terminal shows, moved by scrolling
+	ptrdiff_t shown_view_y;
+	uint8_t  scroll_columns; //Terminal has SL/SR to scroll sideways
+	uint8_t  sync;    //Frames wrapped in synchronized output (DECSET 2026)
+	//Palette resolved for color_mode, refreshed when palette->rgb changes
+	uint32_t rgb[PAL_SIZE];
+	uint32_t colors[PAL_SIZE];
+	uint32_t shown_colors[PAL_SIZE];
+	uint32_t flash_colors[PAL_SIZE];
+	uint8_t  changed[PAL_SIZE];  //Entries whose resolved color changed
+	uint8_t  palette_changed;
+	size_t   rows_encoded;
+	uint8_t  flash;
+	uint8_t  flash_colored;
+	uint8_t  flash_shown;
+	uint8_t  osc_palette;
+	char     flash_osc[1024];
+	char     flash_osc_reset[512];
+	char     status[256];    //Drawn over the top row in reverse video
+	size_t   status_len;
+	size_t   status_shown;   //Columns of the top row it covers now
+} screen_t;
+
+typedef struct {
+	uint8_t enabled;
+	size_t  flash;
+	uint8_t lit;
+	uint8_t updated;  //The screen went lit or dark
+} storm_t;
+
+typedef struct {
+	palette_t *palette;
+	double length;  //Seconds per day, 0 leaves the sky at the terminal default
+	double phase;   //0 is midnight, 0.5 is noon
+	uint8_t updated;  //The palette changed
+} daynight_t;
+
+//Moves the screen's view over a world wider than it
+typedef struct {
+	uint8_t follow;   //Keep the cloud in the middle third of the screen
+	uint8_t updated;  //The view moved
+	ptrdiff_t pan;    //Columns to move by at the next update
+} camera_t;
+
+//Keyboard and SGR mouse input on a stdin in raw mode
+typedef struct {
+	struct termios saved;
+	uint8_t raw;        //stdin is a terminal, saved is how it was
+	uint8_t alternate;  //stdout is a terminal, drawn on its alternate screen
+	uint8_t entered;    //The terminal is set up, to be restored
+	uint8_t quit;
+	uint8_t paused;
+	uint8_t acted;      //Something was done since the last frame was drawn
+	uint8_t osc_palette;  //Lightning may redefine the palette (-o)
+	char    buf[INPUT_BUF];  //Start of a sequence still arriving
+	size_t  len;
+	struct timespec due;     //When the next frame is to be drawn
+} input_t;
+
+//What the terminal answered to the startup probe
+typedef struct {
+	uint8_t colors;          //COLORS_TRUE when it has direct color
+	uint8_t sync;            //Synchronized output (DECSET 2026)
+	uint8_t scroll_columns;  //SL/SR
+} caps_t;
+
+//A glyph drawn in two resolved colors, as RGB or as Y then U and V rows
+typedef struct {
+	uint32_t glyph;
+	uint32_t fg;
+	uint32_t bg;
+	uint8_t  used;
+	uint8_t  pixels[RASTER_CW*RASTER_CH*3];
+} raster_tile_t;
+
+//Frames for video rather than a terminal
+typedef struct {
+	uint8_t format;     //RASTER_RGB or RASTER_Y4M
+	size_t  width;      //Cells
+	size_t  height;
+	uint8_t *frame;     //Packed RGB, or Y, U and V planes
+	size_t  frame_size;
+	shown_t *shown;     //What each cell of the frame holds
+	raster_tile_t *tiles;
+	size_t  hits;
+	size_t  misses;
+} raster_t;
+
+typedef struct {
+	size_t idle;   //Wakeups in a row that drew nothing
+	size_t steps;  //Simulation steps per wakeup
+} pacer_t;
+
+//Output accounting, and a token bucket holding the output under budget
+//bytes per second.  The frame rate drops first, then features are shed.
+typedef struct {
+	size_t   budget;          //Bytes per second, 0 only counts
+	double   tokens;
+	size_t   level;
+	uint8_t  mode;            //Color mode and glyph set asked for
+	uint8_t  glyph_set;
+	uint64_t bytes;           //Since start
+	uint64_t frames;          //Frames written since start
+	uint64_t dropped;         //Frames held back for the budget since start
+	size_t   frame_bytes;     //Last frame written
+	size_t   frame_max;
+	size_t   second_bytes;    //Bytes per second over the last second
+	size_t   window_bytes;
+	size_t   window_frames;
+	size_t   window_dropped;
+	size_t   window_steps;
+	size_t   calm;            //Seconds in a row using under half the budget
+} governor_t;
+
+//A viewer connected to the broadcast server, with its own terminal size
+//and diff state.  It asks for frames with lines of
+//  view WIDTH HEIGHT COLOR_MODE GLYPH_SET
+//and receives terminal output drawn for that size.
+typedef struct {
+	int        fd;
+	size_t     index;     //Position in the server's viewer list
+	termsize_t term;
+	screen_t   screen;
+	uint8_t    ready;     //A view line has been received
+	uint8_t    waiting;   //Output is queued until the socket is writable
+	size_t     sent;      //Bytes of screen.out already written
+	size_t     behind;    //Frames skipped while the last one drained
+	char       in[VIEW_LINE];
+	size_t     in_len;
+} viewer_t;
+
+//Head of a shared memory segment published with -M, SHM_HEADER bytes
+//long and followed by the slots
+typedef struct {
+	uint32_t magic;
+	uint32_t slots;
+	uint32_t width;    //World size in cells
+	uint32_t height;
+	size_t   stride;   //Bytes per slot
+	pid_t    pid;      //Publisher, gone when kill() says so
+	uint64_t frame;    //Newest complete frame, in slot frame%slots
+} shm_header_t;
+
+//One composed world.  seq is odd while the publisher writes the slot; a
+//reader copies the slot and starts over if seq moved meanwhile.
+typedef struct {
+	uint64_t  seq;
+	uint64_t  frame;
+	uint8_t   flash;
+	palette_t palette;
+	cell_t    cells[];
+} shm_slot_t;
+
+typedef struct {
+	shm_header_t *head;
+	size_t size;
+} shm_ring_t;
+
+//The scene the benchmarks and checks run offscreen
+typedef struct {
+	termsize_t term;
+	drips_t drips;
+	cloud_t cloud;
+	water_t water;
+	palette_t palette;
+	screen_t screen;
+} bench_world_t;
+
+//The publisher removes its segment when told to stop
+volatile sig_atomic_t shm_quit = 0;
+
+//The terminal for the signal handlers and atexit() to give back, and set
+//when it was taken again after a stop and needs redrawing
+input_t *input_tty = 0;
+volatile sig_atomic_t input_resumed = 0;
+
+#ifdef STATS
+//Only the frame loop writes the counters.  They are updated with relaxed
+//atomics so a reader never needs a lock to see whole values.
+typedef struct {
+	uint64_t frames;
+	uint64_t count[STAGES];
+	uint64_t total[STAGES];
+	uint64_t max[STAGES];
+	uint64_t recent[STAGES];  //Moving average over about 16 samples
+	uint64_t hist[STAGES][STATS_BUCKETS];
+} stats_t;
+
+char *stage_names[STAGES] = {
+	"termsize", "screen", "drips", "cloud", "water", "daynight", "storm", "render", "encode", "flush",
+};
+stats_t stats;
+volatile sig_atomic_t stats_dump_request = 0;
+#endif
+
+
+params_t *params_current() {
+	return __atomic_load_n(&params,__ATOMIC_ACQUIRE);
+}
+
+
+//Fill in the per frame and fixed point values from the ones read
+void params_derive(params_t *p) {
+	p->frame_delay = 1000000/p->frame_rate;
+	p->frame_gravity = p->gravity/p->frame_rate;
+	p->frame_cloud_speed = p->cloud_speed/p->frame_rate;
+	p->drip_delay = p->drip_interval*p->frame_rate < 1 ? 1 : p->drip_interval*p->frame_rate;
+	p->flash_odds = p->frame_rate*LIGHTNING_SECONDS < 1 ? 1 : p->frame_rate*LIGHTNING_SECONDS;
+	p->fix_gravity = FIX(p->frame_gravity);
+	p->fix_cloud_speed = FIX(p->frame_cloud_speed);
+	p->fix_tension = FIX(p->water_tension);
+	p->fix_dampening = FIX(p->water_dampening);
+	p->fix_spread = FIX(p->water_spread);
+	p->fix_level = FIX(p->water_level);
+}
+
+
+void params_defaults(params_t *p) {
+	p->frame_rate = 10;
+	p->gravity = 9.8;
+	p->cloud_speed = 10;
+	p->drip_interval = 3;
+	p->water_tension = 0.025;
+	p->water_dampening = 0.025;
+	p->water_spread = 0.25;
+	p->water_level = 8;
+}
+
+
+//Set the parameter called name, or return -1 when there is none
+int params_set(params_t *p, const char *name, double value) {
+	size_t i;
+	
+	for( i=0; i<PARAM_KEYS; i++ ) {
+		if( !strcmp(name,param_keys[i].name) ) {
+			*(double*)((char*)p+param_keys[i].offset) = value;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+uint8_t params_valid(params_t *p) {
+	return p->frame_rate > 0 && p->frame_rate <= 1000 && p->drip_interval > 0 &&
+		p->water_tension >= 0 && p->water_dampening >= 0 && p->water_spread >= 0;
+}
+
+
+//The defaults, under whatever the scene sets
+int params_init(params_t *p) {
+	size_t i;
+	
+	if( !p ) {
+		return -1;
+	}
+	params_defaults(p);
+	for( i=0; i<scene.param_count; i++ ) {
+		params_set(p,param_keys[scene.param_keys[i]].name,scene.param_values[i]);
+	}
+	params_derive(p);
+	return 0;
+}
+
+
+//Read a whole file of at most max bytes into text, NUL terminated
+int text_load(const char *path, char *text, size_t max) {
+	size_t len = 0;
+	ssize_t n;
+	int fd;
+	
+	fd = open(path,O_RDONLY);
+	if( fd < 0 ) {
+		return -2;
+	}
+	while( (n = read(fd,text+len,max+1-len)) != 0 ) {
+		if( n < 0 && errno == EINTR ) {
+			continue;
+		}
+		if( n < 0 || len+n > max ) {
+			close(fd);
+			return -3;
+		}
+		len = len + n;
+	}
+	close(fd);
+	text[len] = 0;
+	return 0;
+}
+
+
+//Parse key=value lines from path over the defaults.  Blank lines and
+//anything after # are ignored.  The file is read into a fixed buffer so
+//that a reload never allocates.
+int params_load(params_t *p, const char *path) {
+	char text[PARAMS_FILE_MAX+1];
+	char *line,*next,*eq,*end;
+	double value;
+	int err;
+	
+	if( !p || !path ) {
+		return -1;
+	}
+	err = text_load(path,text,PARAMS_FILE_MAX);
+	if( err ) {
+		return err;
+	}
+	
+	params_init(p);
+	for( line=text; line; line=next ) {
+		next = strchr(line,'\n');
+		if( next ) {
+			*next++ = 0;
+		}
+		if( (end = strchr(line,'#')) ) {
+			*end = 0;
+		}
+		line = line + strspn(line," \t\r");
+		if( !*line ) {
+			continue;
+		}
+		eq = strchr(line,'=');
+		if( !eq ) {
+			return -4;
+		}
+		for( end=eq; end>line && strchr(" \t",end[-1]); end-- );
+		*end = 0;
+		value = strtod(eq+1,&end);
+		if( end == eq+1 || end[strspn(end," \t\r")] ) {
+			return -4;
+		}
+		if( params_set(p,line,value) ) {
+			return -4;
+		}
+	}
+	if( !params_valid(p) ) {
+		return -5;
+	}
+	params_derive(p);
+	return 0;
+}
+
+
+//Load path into the slot not in use and publish it.  Only the frame loop
+//reloads, so the spare slot is never being read.  A bad file leaves the
+//current parameters in place.
+int params_swap(const char *path) {
+	params_t *next;
+	int err;
+	
+	next = params_current() == &params_slots[0] ? &params_slots[1] : &params_slots[0];
+	err = params_load(next,path);
+	if( err ) {
+		return err;
+	}
+	__atomic_store_n(&params,next,__ATOMIC_RELEASE);
+	return 0;
+}
+
+
+void params_hangup(int sig) {
+	(void)sig;
+	params_reload = 1;
+}
+
 
 int termsize_update(termsize_t *term) {
 	struct winsize ws;
@@ -124,6 +936,9 @@ int termsize_update(termsize_t *term) {
 		return -2;
 	}
 	
+	//A terminal that reports no size yet is taken as one cell
+	ws.ws_col = ws.ws_col ? ws.ws_col : 1;
+	ws.ws_row = ws.ws_row ? ws.ws_row : 1;
 	if( ws.ws_col != term->width  || ws.ws_row != term->height ) {
 		term->width = ws.ws_col;
 		term->height = ws.ws_row;
@@ -149,363 +964,5499 @@ int termsize_init(termsize_t* term) {
 }
 
 
-int water_update(water_t *water) {
-	size_t i;
-	size_t j;
-	water_column_t *tmp;
+//Floats the height fields and the obstacle mask take for nx columns
+size_t wave2d_size(size_t nx, size_t nz) {
+	return nz ? 3*(nx+2)*(nz+2) : 0;
+}
+
+
+//Lay the grid out for nx columns in data, which holds wave2d_size()
+//floats.  The heights are resampled from the old layout, which must still
+//be there, so waves survive a resize.
+int wave2d_resize(wave2d_t *wave, float *data, size_t nx) {
+	size_t size = (nx+2)*(wave->nz+2);
+	size_t s = nx+2;
+	size_t i,j,k,z;
+	float *cur;
+	float *prev;
+	double x,t;
 	
-	if( ! water ) {
+	if( !wave ) {
 		return -1;
 	}
-	
-	if( water->term->updated ) {
-		tmp = realloc(water->cols,sizeof(water_column_t)*water->term->width);
-		if( !tmp ) {
-			return -2;
-		}
-		water->cols = tmp;
-		water->target_height = 8;//water->term->height*8/4;
-		for( i=0; i<water->term->width; i++ ) {
-			water->cols[i].height = water->target_height;
-			water->cols[i].speed  = 0.0;
-		}
-		water->island_y = (water->term->height*3/4)-1;
+	if( !wave->nz ) {
+		return 0;
 	}
-	
-	for( i=0; i<water->term->width; i++ ) {
-		water->cols[i].speed = water->cols[i].speed + 
-			( (WATER_TENSION * (water->target_height - water->cols[i].height)) - 
-			  (water->cols[i].speed * WATER_DAMPENING) );
-		water->cols[i].height  = water->cols[i].height + water->cols[i].speed;
+	cur = data;
+	prev = data + size;
+	memset(data,0,sizeof(float)*2*size);
+	for( i=0; i<size; i++ ) {
+		data[2*size+i] = 1;
 	}
-	
-	for( j=0; j<8; j++ ) {
-		for( i=0; i<water->term->width; i++ ) {
-			if( i > 0 ) {
-				water->cols[i].ldelta = WATER_SPREAD * (water->cols[i].height - water->cols[i-1].height);
-				water->cols[i-1].speed = water->cols[i-1].speed + water->cols[i].ldelta;
-			}
-			if( i < water->term->width - 1 ) {
-				water->cols[i].rdelta = WATER_SPREAD * (water->cols[i].height - water->cols[i+1].height);
-				water->cols[i+1].speed = water->cols[i+1].speed + water->cols[i].rdelta;
-			}
-		}
-		for( i=0; i<water->term->width; i++ ) {
-			if( i > 0 ) {
-				water->cols[i-1].height = water->cols[i-1].height + water->cols[i].ldelta;
-			}
-			if( i < water->term->width - 1 ) {
-				water->cols[i+1].height = water->cols[i+1].height + water->cols[i].rdelta;
-			}
+	for( j=0; wave->cur && j<nx; j++ ) {
+		x = ((double)j+0.5)*wave->nx/nx - 0.5;
+		x = x < 0 ? 0 : x;
+		i = (size_t)x < wave->nx ? (size_t)x : wave->nx-1;
+		k = i+1 < wave->nx ? i+1 : i;
+		t = x - i;
+		for( z=1; z<=wave->nz; z++ ) {
+			cur[z*s+j+1] = wave->cur[z*wave->stride+i+1] + 
+				(wave->cur[z*wave->stride+k+1]-wave->cur[z*wave->stride+i+1])*t;
+			prev[z*s+j+1] = wave->prev[z*wave->stride+i+1] + 
+				(wave->prev[z*wave->stride+k+1]-wave->prev[z*wave->stride+i+1])*t;
 		}
 	}
+	wave->nx = nx;
+	wave->stride = s;
+	wave->cur = cur;
+	wave->prev = prev;
+	wave->mask = data + 2*size;
+	wave->island_rx = 0;
+	wave->island_x = 0;
 	return 0;
 }
 
 
-int water_init(water_t *water, termsize_t *term) {
-	if( ! water ) {
-		return -1;
+//Carve the island out of the grid as an ellipse around its waterline
+void wave2d_island(wave2d_t *wave, size_t x, size_t rx) {
+	size_t i,z;
+	float dx,dz;
+	float rz;
+	float *row;
+	
+	if( rx == wave->island_rx && x == wave->island_x ) {
+		return;
 	}
-	if( ! term ) {
-		return -2;
+	wave->island_rx = rx;
+	wave->island_x = x;
+	rz = rx/2.0 < 1 ? 1 : rx/2.0;
+	for( z=0; z<wave->nz; z++ ) {
+		row = &wave->mask[(z+1)*wave->stride+1];
+		dz = (z - wave->nz/2.0f)/rz;
+		for( i=0; i<wave->nx; i++ ) {
+			dx = rx ? ((float)i - x)/rx : 2;
+			row[i] = dx*dx + dz*dz <= 1 ? 0 : 1;
+		}
 	}
-	water->cols = 0;
-	water->term = term;
-	return water_update(water);
 }
 
 
-#define CM_UNKNOWN  0
-#define CM_CLOUD    1
-#define CM_ISLAND   2
-#define CM_WATER_FG 3
-#define CM_WATER_BG 4
-
-int render( water_t *water, drips_t *drips, cloud_t *cloud) {
-	size_t y,x,i;
-	float y_water_height;
-	uint8_t move = 1;
-	uint8_t color_mode;
-	for( y=0; y<water->term->height; y++ ) {
-		y_water_height = (water->term->height-y)*8;
-		color_mode = CM_UNKNOWN;
-		for( x=0; x<water->term->width; x++ ) {
-			//Set background color for island
-			if( y == water->island_y-5 &&
-					(x==(water->term->width/2)-3 || x==(water->term->width/2)-1 || x==(water->term->width/2)+1 ) ) {
-				printf("\x1b[%d;%dm",fgcolors[4],bgcolors[2]);
-				color_mode = CM_ISLAND;
-			}
-			else if( y == water->island_y-4 &&
-					(x>=(water->term->width/2)-2 && x<=(water->term->width/2) ) ) {
-				printf("\x1b[%d;%dm",fgcolors[4],bgcolors[2]);
-				color_mode = CM_ISLAND;
-			}
-			else if( y == water->island_y-3 &&
-					(x==(water->term->width/2)-3 || x==(water->term->width/2)+1 ) ) {
-				printf("\x1b[%d;%dm",fgcolors[4],bgcolors[2]);
-				color_mode = CM_ISLAND;
-			}
-			else if( y == water->island_y-3 &&
-					x==(water->term->width/2)-1 ){
-				printf("\x1b[%d;%dm",fgcolors[4],bgcolors[3]);
-				color_mode = CM_ISLAND;
-			}
-			else if( (y == water->island_y-2 || y == water->island_y-1) &&
-					x==(water->term->width/2) ) {
-				printf("\x1b[%d;%dm",fgcolors[4],bgcolors[3]);
-				color_mode = CM_ISLAND;
-			}
-			else if( y >= water->island_y && 
-					x >= (water->term->width/2) - (1+2*(y-water->island_y)) && 
-					x <= (water->term->width/2) + (1+2*(y-water->island_y)) ) {
-				printf("\x1b[%d;%dm",fgcolors[4],bgcolors[11]);
-				color_mode = CM_ISLAND;
-			} 
-			else if( color_mode == CM_ISLAND ) {
-				printf("\x1b[%d;%dm",fgcolors[0],bgcolors[0]);
-				color_mode = CM_UNKNOWN;
-			}
-			
-			//Render Drips
-			for( i=0; i<drips->size; i++ ) {
-				if( drips->drips[i].active ) {
-					if( (y == ((drips->term->height*8)-drips->drips[i].y)/8) && (x == drips->drips[i].x) ) {
-						if( color_mode != CM_WATER_FG ) {
-							printf("\x1b[%dm",fgcolors[4]);
-							color_mode = CM_WATER_FG;
-						}
-						if( move ) {
-							printf("\x1b[%ld;%ldH",y+1, x+1);
-						}
-						printf("%s",drip_char);
-						continue;
-					}
-				}
-			}
-			
-			//Render Cloud
-			if( y >= 0 && y <=2 && x == (int)(cloud->pos/8) ) {
-				if( move ) {
-					printf("\x1b[%ld;%ldH",y+1, x+1);
-				}
-				if( color_mode != CM_CLOUD ) {
-					printf("\x1b[%d;%dm",fgcolors[15],bgcolors[0]);
-					color_mode = CM_CLOUD;
-				}
-				printf("%s",cloud_char[y]);
-				move = 1;
-				continue;
-			}
-			
-			//Render empty island characters
-			if( water->cols[x].height < (y_water_height-8) ) {
-				if( color_mode == CM_ISLAND ) {
-					if( move ) {
-						printf("\x1b[%ld;%ldH",y+1, x+1);
-						move = 0;
-					}
-					printf(" ");
-				}
-				else {
-					move = 1;
-				}
-			}
-			//Render water
-			else {
-				if( move ) {
-					printf("\x1b[%ld;%ldH",y+1, x+1);
-					move = 0;
-				}
-				//Completely underwater (blue is background)
-				if( water->cols[x].height >= y_water_height ) {
-					if( color_mode != CM_WATER_BG ) {
-						printf("\x1b[%dm",bgcolors[4]);
-						color_mode = CM_WATER_BG;
-					}
-					printf(" ");
-				}
-				//Water line (blue is foreground)
-				else {
-					if( color_mode != CM_WATER_FG && color_mode != CM_ISLAND ) {
-						printf("\x1b[%d;%dm",fgcolors[4],bgcolors[0]);
-						color_mode = CM_WATER_FG;
-					}
-					printf("%s",water_chars[ (int)water->cols[x].height % 8 ] );
-				}
-			}
-		}
+//Reflecting edges: the halo mirrors the cells next to it
+void wave2d_halo(wave2d_t *wave) {
+	size_t i;
+	size_t s = wave->stride;
+	float *f = wave->cur;
+	
+	for( i=1; i<=wave->nz; i++ ) {
+		f[i*s] = f[i*s+1];
+		f[i*s+wave->nx+1] = f[i*s+wave->nx];
 	}
+	memcpy(f,f+s,sizeof(float)*s);
+	memcpy(f+(wave->nz+1)*s,f+wave->nz*s,sizeof(float)*s);
 }
 
 
-int drips_init(drips_t* drips, termsize_t *term) {
-	if( !drips ) {
-		return -1;
+//One row of the damped wave equation over [x0,x1), written in place over prev
+void wave2d_row(const float *restrict cur, float *restrict prev, const float *restrict mask,
+		size_t stride, size_t x0, size_t x1) {
+	wave_vec_t l,r,u,d,p,m,n;
+	size_t x = x0;
+	
+	for( ; x+WAVE_VEC<=x1; x+=WAVE_VEC ) {
+		memcpy(&l,cur+x-1,sizeof(l));
+		memcpy(&r,cur+x+1,sizeof(r));
+		memcpy(&u,cur+x-stride,sizeof(u));
+		memcpy(&d,cur+x+stride,sizeof(d));
+		memcpy(&p,prev+x,sizeof(p));
+		memcpy(&m,mask+x,sizeof(m));
+		n = ((l+r+u+d)*0.5f - p)*WAVE_DAMPING*m;
+		memcpy(prev+x,&n,sizeof(n));
 	}
-	if( !term ) {
-		return -2;
+	for( ; x<x1; x++ ) {
+		prev[x] = ((cur[x-1]+cur[x+1]+cur[x-stride]+cur[x+stride])*0.5f - prev[x])*WAVE_DAMPING*mask[x];
 	}
-	drips->term = term;
-	drips->size = 0;
-	drips->drips = 0;
-	return 0;
 }
 
 
-int drips_generate(drips_t* drips, size_t x) {
-	size_t i;
-	drip_t *tmp;
+//Advance the height field one substep.  The grid is swept in tiles so the
+//three rows each tile reads stay in cache, and tiles run in parallel when
+//built with OpenMP.
+void wave2d_step(wave2d_t *wave) {
+	size_t tiles_x = (wave->nx+WAVE_TILE_X-1)/WAVE_TILE_X;
+	size_t tiles_z = (wave->nz+WAVE_TILE_Z-1)/WAVE_TILE_Z;
+	size_t t;
+	float *tmp;
 	
-	if( ! drips ) {
-		return -1;
+	wave2d_halo(wave);
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static)
+#endif
+	for( t=0; t<tiles_x*tiles_z; t++ ) {
+		size_t x0 = 1+(t%tiles_x)*WAVE_TILE_X;
+		size_t x1 = x0+WAVE_TILE_X < wave->nx+1 ? x0+WAVE_TILE_X : wave->nx+1;
+		size_t z0 = 1+(t/tiles_x)*WAVE_TILE_Z;
+		size_t z1 = z0+WAVE_TILE_Z < wave->nz+1 ? z0+WAVE_TILE_Z : wave->nz+1;
+		size_t z;
+		
+		for( z=z0; z<z1; z++ ) {
+			wave2d_row(wave->cur+z*wave->stride,wave->prev+z*wave->stride,
+				wave->mask+z*wave->stride,wave->stride,x0,x1);
+		}
 	}
+	tmp = wave->cur;
+	wave->cur = wave->prev;
+	wave->prev = tmp;
+}
+
+
+//Seen from the side, each column shows the highest crest along its depth.
+//Returns the largest displacement anywhere in the grid.
+float wave2d_silhouette(wave2d_t *wave, water_column_t *cols, float base) {
+	size_t i,z;
+	float *row;
+	float low = 0;
+	float high = 0;
 	
-	for( i=0; i<drips->size; i++ ) {
-		if( ! drips->drips[i].active ) {
-			break;
-		}
+	for( i=0; i<wave->nx; i++ ) {
+		cols[i].height = -1e30f;
 	}
-	if( i == drips->size ) {
-		tmp = realloc(drips->drips,sizeof(drip_t)*(drips->size+1));
-		if( ! tmp ) {
-			return -2;
+	for( z=1; z<=wave->nz; z++ ) {
+		row = &wave->cur[z*wave->stride+1];
+		for( i=0; i<wave->nx; i++ ) {
+			cols[i].height = row[i] > cols[i].height ? row[i] : cols[i].height;
+			low = row[i] < low ? row[i] : low;
 		}
-		drips->drips = tmp;
-		drips->size++;
+	}
+	for( i=0; i<wave->nx; i++ ) {
+		high = cols[i].height > high ? cols[i].height : high;
+		cols[i].height = base + cols[i].height;
+	}
+	return high > -low ? high : -low;
+}
+
+
+//Side view 2D water: impulses left in the column speeds by drips_update()
+//are injected into the grid between the viewer and the island
+int water_update_2d(water_t *water) {
+	wave2d_t *wave = &water->wave;
+	size_t surface_row;
+	size_t i;
+	
+	surface_row = water->term->height - 1 - (size_t)(water->target_height/8);
+	if( scene.island && surface_row >= water->island_y && surface_row < water->term->height ) {
+		wave2d_island(wave,water->term->width/2,1+2*(surface_row-water->island_y));
+	}
+	else {
+		wave2d_island(wave,water->term->width/2,0);
+	}
+	for( i=0; i<wave->nx; i++ ) {
+		if( water->cols[i].speed != 0 ) {
+			wave->cur[(wave->nz/4+1)*wave->stride+i+1] += water->cols[i].speed;
+			water->cols[i].speed = 0;
+		}
+	}
+	for( i=0; i<WAVE_STEPS; i++ ) {
+		wave2d_step(wave);
+	}
+	if( wave2d_silhouette(wave,water->cols,water->target_height) < WATER_IDLE ) {
+		memset(wave->cur,0,sizeof(float)*wave->stride*(wave->nz+2));
+		memset(wave->prev,0,sizeof(float)*wave->stride*(wave->nz+2));
+		for( i=0; i<wave->nx; i++ ) {
+			water->cols[i].height = water->target_height;
+		}
+		water->idle = 1;
+	}
+	return 0;
+}
+
+
+//Put columns [lo,hi] back at rest on the target
+void water_settle(water_t *water, size_t lo, size_t hi) {
+	size_t i;
+	
+	for( i=lo; i<=hi; i++ ) {
+		if( water->fixed ) {
+			water->fix_height[i] = water->fix_target;
+			water->fix_speed[i] = 0;
+		}
+		water->cols[i].height = water->target_height;
+		water->cols[i].speed = 0;
+	}
+}
+
+
+uint8_t water_moving(water_t *water, size_t i) {
+	fix_t offset;
+	
+	if( water->fixed ) {
+		offset = water->fix_height[i] - water->fix_target;
+		return (offset < 0 ? -offset : offset) >= FIX(WATER_IDLE) ||
+			(water->fix_speed[i] < 0 ? -water->fix_speed[i] : water->fix_speed[i]) >= FIX(WATER_IDLE);
+	}
+	return fabsf(water->cols[i].height - water->target_height) >= WATER_IDLE ||
+		fabsf(water->cols[i].speed) >= WATER_IDLE;
+}
+
+
+//Mark column x as disturbed, joining the span it is within reach of
+void water_activate(water_t *water, size_t x) {
+	water_span_t *spans = water->spans;
+	size_t i;
+	
+	water->impulse = 1;
+	if( x >= water->term->width ) {
+		return;
+	}
+	for( i=0; i<water->span_count; i++ ) {
+		if( x+2*WATER_PASSES >= spans[i].lo && x <= spans[i].hi+2*WATER_PASSES ) {
+			spans[i].lo = x < spans[i].lo ? x : spans[i].lo;
+			spans[i].hi = x > spans[i].hi ? x : spans[i].hi;
+			return;
+		}
+		if( spans[i].lo > x ) {
+			break;
+		}
+	}
+	//Out of spans, stretch the nearer neighbor over the gap instead
+	if( water->span_count == WATER_SPANS ) {
+		if( i == WATER_SPANS || (i > 0 && x-spans[i-1].hi < spans[i].lo-x) ) {
+			spans[i-1].hi = x;
+		}
+		else {
+			spans[i].lo = x;
+		}
+		return;
+	}
+	memmove(&spans[i+1],&spans[i],sizeof(water_span_t)*(water->span_count-i));
+	spans[i].lo = x;
+	spans[i].hi = x;
+	water->span_count++;
+}
+
+
+//Columns outside the spans follow the target as it rises
+void water_rest(water_t *water) {
+	size_t lo = 0;
+	size_t hi;
+	size_t k;
+	
+	if( water->fixed ? water->fix_rest == water->fix_target : water->rest_height == water->target_height ) {
+		return;
+	}
+	for( k=0; k<=water->span_count; k++ ) {
+		hi = k < water->span_count ? water->spans[k].lo : water->term->width;
+		if( hi > lo ) {
+			water_settle(water,lo,hi-1);
+		}
+		if( k < water->span_count ) {
+			lo = water->spans[k].hi+1;
+		}
+	}
+	water->rest_height = water->target_height;
+	water->fix_rest = water->fix_target;
+}
+
+
+//A wave travels at most one column per spread pass, so each span can reach
+//WATER_PASSES further this frame.  Spans that meet are merged.
+void water_grow(water_t *water) {
+	water_span_t *spans = water->spans;
+	size_t w = water->term->width;
+	size_t count = 0;
+	size_t lo,hi;
+	size_t k;
+	
+	for( k=0; k<water->span_count; k++ ) {
+		lo = spans[k].lo > WATER_PASSES ? spans[k].lo-WATER_PASSES : 0;
+		hi = spans[k].hi+WATER_PASSES < w ? spans[k].hi+WATER_PASSES : w-1;
+		if( count && lo <= spans[count-1].hi+1 ) {
+			spans[count-1].hi = hi > spans[count-1].hi ? hi : spans[count-1].hi;
+		}
+		else {
+			spans[count].lo = lo;
+			spans[count].hi = hi;
+			count++;
+		}
+	}
+	water->span_count = count;
+}
+
+
+//Trim the quiet ends off each span and split it where a quiet gap is too
+//wide for the waves on either side to meet this frame.  Columns left
+//outside are put back at rest.
+void water_shrink(water_t *water) {
+	water_span_t spans[WATER_SPANS];
+	size_t count = 0;
+	size_t i,j,k;
+	
+	for( k=0; k<water->span_count; k++ ) {
+		for( i=water->spans[k].lo; i<=water->spans[k].hi; i++ ) {
+			if( !water_moving(water,i) ) {
+				continue;
+			}
+			if( count && (i <= spans[count-1].hi+2*WATER_PASSES+1 || count == WATER_SPANS) ) {
+				spans[count-1].hi = i;
+			}
+			else {
+				spans[count].lo = i;
+				spans[count].hi = i;
+				count++;
+			}
+		}
+	}
+	j = 0;
+	for( k=0; k<water->span_count; k++ ) {
+		for( i=water->spans[k].lo; i<=water->spans[k].hi; i++ ) {
+			while( j < count && spans[j].hi < i ) {
+				j++;
+			}
+			if( j == count || i < spans[j].lo ) {
+				water_settle(water,i,i);
+			}
+		}
+	}
+	memcpy(water->spans,spans,sizeof(water_span_t)*count);
+	water->span_count = count;
+}
+
+
+//The column model over one span.  Its ends act as walls, which is exact
+//while the columns beyond them are still at rest.
+void water_span(water_t *water, size_t lo, size_t hi) {
+	water_column_t *cols = water->cols;
+	const params_t *p = params_current();
+	float tension = p->water_tension;
+	float dampening = p->water_dampening;
+	float factor = p->water_spread;
+	float spread;
+	size_t i;
+	size_t j;
+	
+	for( i=lo; i<=hi; i++ ) {
+		cols[i].speed = cols[i].speed + 
+			( (tension * (water->target_height - cols[i].height)) - 
+			  (cols[i].speed * dampening) );
+		cols[i].height  = cols[i].height + cols[i].speed;
+	}
+	
+	for( j=0; j<WATER_PASSES; j++ ) {
+		spread = 0;
+		for( i=lo; i<=hi; i++ ) {
+			if( i > lo ) {
+				cols[i].ldelta = factor * (cols[i].height - cols[i-1].height);
+				cols[i-1].speed = cols[i-1].speed + cols[i].ldelta;
+				spread = fabsf(cols[i].ldelta) > spread ? fabsf(cols[i].ldelta) : spread;
+			}
+			if( i < hi ) {
+				cols[i].rdelta = factor * (cols[i].height - cols[i+1].height);
+				cols[i+1].speed = cols[i+1].speed + cols[i].rdelta;
+			}
+		}
+		for( i=lo; i<=hi; i++ ) {
+			if( i > lo ) {
+				cols[i-1].height = cols[i-1].height + cols[i].ldelta;
+			}
+			if( i < hi ) {
+				cols[i+1].height = cols[i+1].height + cols[i].rdelta;
+			}
+		}
+		water->spread_passes++;
+		if( spread < WATER_CONVERGED ) {
+			break;
+		}
+	}
+}
+
+
+//The column model in fixed point.  Integer addition is associative, so the
+//spread passes are restructured into separate loops over one delta per pair
+//of neighbors, which vectorize on integer lanes.
+void water_span_fixed(water_t *water, size_t lo, size_t hi) {
+	fix_t *h = water->fix_height;
+	fix_t *v = water->fix_speed;
+	fix_t *d = water->fix_delta;
+	const params_t *p = params_current();
+	fix_t tension = p->fix_tension;
+	fix_t dampening = p->fix_dampening;
+	fix_t factor = p->fix_spread;
+	fix_t spread;
+	size_t i;
+	size_t j;
+	
+	for( i=lo; i<=hi; i++ ) {
+		v[i] = v[i] + FIX_MUL(tension,water->fix_target - h[i]) - FIX_MUL(v[i],dampening);
+		h[i] = h[i] + v[i];
+	}
+	
+	for( j=0; j<WATER_PASSES && hi>lo; j++ ) {
+		spread = 0;
+		for( i=lo; i<hi; i++ ) {
+			d[i] = FIX_MUL(factor,h[i+1] - h[i]);
+			spread = spread | d[i];
+		}
+		//Integer deltas converge exactly
+		if( !spread ) {
+			break;
+		}
+		water->spread_passes++;
+		v[lo] = v[lo] + d[lo];
+		h[lo] = h[lo] + d[lo];
+		for( i=lo+1; i<hi; i++ ) {
+			v[i] = v[i] + d[i] - d[i-1];
+			h[i] = h[i] + d[i] - d[i-1];
+		}
+		v[hi] = v[hi] - d[hi-1];
+		h[hi] = h[hi] - d[hi-1];
+	}
+	
+	for( i=lo; i<=hi; i++ ) {
+		water->cols[i].height = FIX_FLOAT(h[i]);
+	}
+}
+
+
+//Lay the columns out for the world's current size.  Heights and speeds,
+//and the 2D grid's heights, are resampled onto the new width, so waves
+//survive a resize.  The new layout, grid included, is one allocation
+//replacing the old.
+int water_resize(water_t *water) {
+	size_t w = water->term->width;
+	size_t h = water->term->height;
+	size_t ow = water->width;
+	size_t i,j,k;
+	water_column_t *cols;
+	fix_t *fix_height;
+	fix_t *fix_speed;
+	double x,t;
+	fix_t weight;
+	float top;
+	
+	if( water->cols && w == water->width && h == water->height ) {
+		return 0;
+	}
+	cols = malloc((sizeof(water_column_t)+sizeof(int32_t)+sizeof(float)+4*sizeof(fix_t))*w + 
+		sizeof(float)*wave2d_size(w,water->wave.nz));
+	if( !cols ) {
+		return -1;
+	}
+	fix_height = (fix_t*)((int32_t*)(cols + w) + w);
+	fix_speed = fix_height + w;
+	memset(fix_speed+2*w,0,(sizeof(fix_t)+sizeof(float))*w);
+	if( !water->cols ) {
+		water->target_height = params_current()->water_level;
+		water->fix_target = params_current()->fix_level;
+	}
+	//The sea can not rise into the sky
+	top = h > 3 ? (h-3)*8 : 0;
+	if( water->target_height > top ) {
+		water->target_height = top;
+		water->fix_target = FIX_ONE*(fix_t)top;
+	}
+	water->rest_height = water->target_height;
+	water->fix_rest = water->fix_target;
+	for( j=0; j<w; j++ ) {
+		cols[j].ldelta = 0;
+		cols[j].rdelta = 0;
+		if( !water->cols ) {
+			cols[j].height = water->target_height;
+			cols[j].speed = 0;
+			fix_height[j] = water->fix_target;
+			fix_speed[j] = 0;
+			continue;
+		}
+		//Sample the old columns at this column's center
+		x = ((double)j+0.5)*ow/w - 0.5;
+		x = x < 0 ? 0 : x;
+		i = (size_t)x < ow ? (size_t)x : ow-1;
+		k = i+1 < ow ? i+1 : i;
+		t = x - i;
+		weight = (fix_t)(t*256);
+		cols[j].height = water->cols[i].height + (water->cols[k].height-water->cols[i].height)*t;
+		cols[j].speed = water->cols[i].speed + (water->cols[k].speed-water->cols[i].speed)*t;
+		fix_height[j] = water->fix_height[i] + (water->fix_height[k]-water->fix_height[i])/256*weight;
+		fix_speed[j] = water->fix_speed[i] + (water->fix_speed[k]-water->fix_speed[i])/256*weight;
+	}
+	//Resampled columns are simulated until they settle, fresh ones are at rest
+	water->span_count = 0;
+	if( water->cols ) {
+		water->spans[0].lo = 0;
+		water->spans[0].hi = w-1;
+		water->span_count = 1;
+		water->impulse = 1;
+	}
+	wave2d_resize(&water->wave,(float*)(fix_speed+3*w)+w,w);
+	free(water->cols);
+	water->cols = cols;
+	water->surface = (int32_t*)(cols + w);
+	water->fix_height = fix_height;
+	water->fix_speed = fix_speed;
+	water->fix_delta = fix_speed + w;
+	water->fix_splash = water->fix_delta + w;
+	water->splash = (float*)(water->fix_splash + w);
+	water->width = w;
+	water->height = h;
+	water->island_y = h*3/4 ? h*3/4-1 : 0;
+	return 0;
+}
+
+
+int water_update(water_t *water) {
+	size_t k;
+	
+	if( ! water ) {
+		return -1;
+	}
+	
+	if( water_resize(water) ) {
+		return -2;
+	}
+	//A calm surface costs nothing until something lands on it
+	if( water->idle && !water->impulse && !water->term->updated ) {
+		water->idle_frames++;
+		water->updated = 0;
+		return 0;
+	}
+	water->updated = 1;
+	water->idle = 0;
+	water->impulse = 0;
+	if( water->wave.nz ) {
+		water->span_count = 0;
+		return water_update_2d(water);
+	}
+	if( water->fixed ) {
+		water->target_height = FIX_FLOAT(water->fix_target);
+	}
+	
+	//Only the disturbed spans are simulated
+	water_rest(water);
+	water_grow(water);
+	for( k=0; k<water->span_count; k++ ) {
+		if( water->fixed ) {
+			water_span_fixed(water,water->spans[k].lo,water->spans[k].hi);
+		}
+		else {
+			water_span(water,water->spans[k].lo,water->spans[k].hi);
+		}
+		water->span_columns += water->spans[k].hi - water->spans[k].lo + 1;
+	}
+	water_shrink(water);
+	water->idle = water->span_count == 0;
+	return 0;
+}
+
+
+//A depth of 0 selects the 1D column model, otherwise the 2D solver is
+//run with that many rows into the screen
+int water_init(water_t *water, termsize_t *term, size_t depth) {
+	if( ! water ) {
+		return -1;
+	}
+	if( ! term ) {
+		return -2;
+	}
+	water->cols = 0;
+	water->width = 0;
+	water->height = 0;
+	water->fixed = 0;
+	water->idle = 0;
+	water->impulse = 0;
+	water->updated = 0;
+	water->spread_passes = 0;
+	water->idle_frames = 0;
+	water->span_count = 0;
+	water->span_columns = 0;
+	water->term = term;
+	water->wave.nz = depth;
+	water->wave.nx = 0;
+	water->wave.cur = 0;
+	return water_update(water);
+}
+
+
+void glyphs_init() {
+	size_t i,j;
+	
+	glyphs[GLYPHS_UNICODE][GLYPH_SPACE] = " ";
+	glyphs[GLYPHS_UNICODE][GLYPH_CLOUD] = "@";
+	glyphs[GLYPHS_UNICODE][GLYPH_DRIP]  = drip_char;
+	glyphs[GLYPHS_ASCII][GLYPH_SPACE] = " ";
+	glyphs[GLYPHS_ASCII][GLYPH_CLOUD] = "@";
+	glyphs[GLYPHS_ASCII][GLYPH_DRIP]  = "o";
+	for( i=0; i<8; i++ ) {
+		glyphs[GLYPHS_UNICODE][GLYPH_WATER+i] = water_chars[i];
+		glyphs[GLYPHS_ASCII][GLYPH_WATER+i] = ascii_water_chars[i];
+	}
+	for( j=0; j<GLYPH_SETS; j++ ) {
+		for( i=0; i<GLYPH_COUNT; i++ ) {
+			glyph_len[j][i] = strlen(glyphs[j][i]);
+		}
+	}
+}
+
+
+uint32_t rgb_distance(uint32_t a, uint32_t b) {
+	int32_t dr = (int32_t)((a>>16)&0xff) - (int32_t)((b>>16)&0xff);
+	int32_t dg = (int32_t)((a>>8)&0xff) - (int32_t)((b>>8)&0xff);
+	int32_t db = (int32_t)(a&0xff) - (int32_t)(b&0xff);
+	return dr*dr + dg*dg + db*db;
+}
+
+
+uint8_t cube_index(uint8_t v) {
+	if( v < 0x30 ) {
+		return 0;
+	}
+	if( v < 0x73 ) {
+		return 1;
+	}
+	return (v-0x23)/0x28;
+}
+
+
+//Build the RGB555 quantization tables so that downgrading a color to
+//the 256 or 16 color palettes is a single lookup
+void colors_init() {
+	uint32_t key;
+	uint32_t rgb;
+	uint32_t cube;
+	uint32_t gray;
+	uint32_t best;
+	uint32_t d;
+	uint8_t r,g,b;
+	uint8_t level;
+	size_t i;
+	
+	for( key=0; key<32768; key++ ) {
+		r = ((key>>10)&0x1f)<<3 | ((key>>12)&0x07);
+		g = ((key>>5)&0x1f)<<3 | ((key>>7)&0x07);
+		b = (key&0x1f)<<3 | ((key>>2)&0x07);
+		rgb = (r<<16) | (g<<8) | b;
+		
+		quant16[key] = 0;
+		best = UINT32_MAX;
+		for( i=0; i<16; i++ ) {
+			d = rgb_distance(rgb,ansi_rgb[i]);
+			if( d < best ) {
+				best = d;
+				quant16[key] = i;
+			}
+		}
+		
+		//Nearest of the 6x6x6 cube and the 24 step gray ramp
+		cube = (cube_levels[cube_index(r)]<<16) | (cube_levels[cube_index(g)]<<8) | cube_levels[cube_index(b)];
+		level = (r+g+b)/3 < 8 ? 0 : ((r+g+b)/3-3)/10;
+		if( level > 23 ) {
+			level = 23;
+		}
+		gray = (8+level*10)*0x010101;
+		if( rgb_distance(rgb,cube) <= rgb_distance(rgb,gray) ) {
+			quant256[key] = 16 + 36*cube_index(r) + 6*cube_index(g) + cube_index(b);
+		}
+		else {
+			quant256[key] = 232 + level;
+		}
+	}
+}
+
+
+uint32_t color_resolve(uint32_t rgb, uint8_t mode) {
+	if( rgb == COLOR_DEFAULT ) {
+		return COLOR_DEFAULT;
+	}
+	if( mode == COLORS_TRUE ) {
+		return rgb;
+	}
+	if( mode == COLORS_256 ) {
+		return quant256[RGB15(rgb)];
+	}
+	return quant16[RGB15(rgb)];
+}
+
+
+uint32_t rgb_lerp(uint32_t a, uint32_t b, uint32_t t, uint32_t scale) {
+	uint32_t c = 0;
+	uint32_t shift;
+	uint32_t ca,cb;
+	
+	for( shift=0; shift<24; shift+=8 ) {
+		ca = (a>>shift)&0xff;
+		cb = (b>>shift)&0xff;
+		c = c | (((ca*(scale-t) + cb*t)/scale)<<shift);
+	}
+	return c;
+}
+
+
+//Fill palette entries [first,first+count) with a gradient from a to b
+void palette_gradient(palette_t *palette, size_t first, size_t count, uint32_t a, uint32_t b) {
+	size_t i;
+	
+	for( i=0; i<count; i++ ) {
+		palette->rgb[first+i] = rgb_lerp(a,b,i,count > 1 ? count-1 : 1);
+	}
+}
+
+
+int palette_init(palette_t *palette) {
+	size_t i;
+	
+	if( !palette ) {
+		return -1;
+	}
+	for( i=0; i<PAL_SIZE; i++ ) {
+		palette->rgb[i] = COLOR_DEFAULT;
+		palette->flash[i] = i;
+	}
+	palette->rgb[PAL_BLACK]       = ansi_rgb[0];
+	palette->rgb[PAL_WATER]       = ansi_rgb[4];
+	palette->rgb[PAL_GRASS]       = ansi_rgb[2];
+	palette->rgb[PAL_TRUNK]       = ansi_rgb[3];
+	palette->rgb[PAL_SAND]        = ansi_rgb[11];
+	palette->rgb[PAL_CLOUD]       = ansi_rgb[15];
+	palette->rgb[PAL_FLASH_SKY]   = 0xe0e0ff;
+	palette->rgb[PAL_FLASH_WATER] = 0xa0d0ff;
+	palette->rgb[PAL_FLASH_GRASS] = 0xa0ffa0;
+	palette->rgb[PAL_FLASH_TRUNK] = 0xffffb0;
+	palette->rgb[PAL_FLASH_SAND]  = 0xfffff0;
+	palette_gradient(palette,PAL_DEPTH,DEPTH_BANDS,ansi_rgb[4],0x00008c);
+	
+	palette->flash[PAL_DEFAULT] = PAL_FLASH_SKY;
+	palette->flash[PAL_WATER]   = PAL_FLASH_WATER;
+	palette->flash[PAL_GRASS]   = PAL_FLASH_GRASS;
+	palette->flash[PAL_TRUNK]   = PAL_FLASH_TRUNK;
+	palette->flash[PAL_SAND]    = PAL_FLASH_SAND;
+	for( i=0; i<DEPTH_BANDS; i++ ) {
+		palette->flash[PAL_DEPTH+i] = PAL_FLASH_WATER;
+	}
+	for( i=0; i<SKY_BANDS; i++ ) {
+		palette->flash[PAL_SKY+i] = PAL_FLASH_SKY;
+	}
+	for( i=0; i<PAL_FLASH_SKY; i++ ) {
+		if( scene.colors[i] != COLOR_ANY ) {
+			palette->rgb[i] = scene.colors[i];
+		}
+	}
+	return 0;
+}
+
+
+int outbuf_init(outbuf_t *out) {
+	if( !out ) {
+		return -1;
+	}
+	out->data = 0;
+	out->len = 0;
+	out->size = 0;
+	return 0;
+}
+
+
+int outbuf_reserve(outbuf_t *out, size_t n) {
+	char *tmp;
+	
+	if( out->len + n <= out->size ) {
+		return 0;
+	}
+	tmp = realloc(out->data,out->len+n);
+	if( !tmp ) {
+		return -1;
+	}
+	out->data = tmp;
+	out->size = out->len+n;
+	return 0;
+}
+
+
+//The out_* helpers assume space was already reserved with outbuf_reserve
+void out_bytes(outbuf_t *out, const char *s, size_t n) {
+	memcpy(out->data+out->len,s,n);
+	out->len += n;
+}
+
+
+void out_str(outbuf_t *out, const char *s) {
+	out_bytes(out,s,strlen(s));
+}
+
+
+void out_num(outbuf_t *out, size_t v) {
+	char tmp[20];
+	size_t n = 0;
+	
+	do {
+		tmp[n++] = '0' + v%10;
+		v = v/10;
+	} while( v );
+	while( n ) {
+		out->data[out->len++] = tmp[--n];
+	}
+}
+
+
+int outbuf_flush(outbuf_t *out, int fd) {
+	size_t done = 0;
+	ssize_t n;
+	
+	if( !out ) {
+		return -1;
+	}
+	while( done < out->len ) {
+		n = write(fd,out->data+done,out->len-done);
+		if( n < 0 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			out->len = 0;
+			return -2;
+		}
+		done = done + n;
+	}
+	out->len = 0;
+	return 0;
+}
+
+
+void screen_move(screen_t *screen, size_t x, size_t y) {
+	outbuf_t *out = &screen->out;
+	
+	if( screen->cur_y == y && screen->cur_x == x ) {
+		return;
+	}
+	//Short hops right on the same row are cheaper as CUF than CUP
+	if( screen->cur_y == y && screen->cur_x < x ) {
+		out_bytes(out,"\x1b[",2);
+		if( x - screen->cur_x > 1 ) {
+			out_num(out,x - screen->cur_x);
+		}
+		out_bytes(out,"C",1);
+	}
+	else {
+		out_bytes(out,"\x1b[",2);
+		out_num(out,y+1);
+		out_bytes(out,";",1);
+		out_num(out,x+1);
+		out_bytes(out,"H",1);
+	}
+	screen->cur_x = x;
+	screen->cur_y = y;
+}
+
+
+//Append the SGR parameters selecting color c as foreground (base 30) or
+//background (base 40) in color mode
+void screen_color(screen_t *screen, uint32_t c, uint8_t base, uint8_t mode) {
+	outbuf_t *out = &screen->out;
+	
+	if( c == COLOR_DEFAULT ) {
+		out_num(out,base+9);
+	}
+	else if( mode == COLORS_TRUE ) {
+		out_num(out,base+8);
+		out_bytes(out,";2;",3);
+		out_num(out,(c>>16)&0xff);
+		out_bytes(out,";",1);
+		out_num(out,(c>>8)&0xff);
+		out_bytes(out,";",1);
+		out_num(out,c&0xff);
+	}
+	else if( mode == COLORS_256 ) {
+		out_num(out,base+8);
+		out_bytes(out,";5;",3);
+		out_num(out,c);
+	}
+	else {
+		out_num(out,base == 30 ? fgcolors[c] : bgcolors[c]);
+	}
+}
+
+
+void screen_sgr(screen_t *screen, uint32_t fg, uint32_t bg, uint8_t mode) {
+	outbuf_t *out = &screen->out;
+	uint8_t set_fg = fg != COLOR_ANY && fg != screen->pen_fg;
+	uint8_t set_bg = bg != screen->pen_bg;
+	
+	if( !set_fg && !set_bg ) {
+		return;
+	}
+	out_bytes(out,"\x1b[",2);
+	if( set_fg ) {
+		screen_color(screen,fg,30,mode);
+		screen->pen_fg = fg;
+	}
+	if( set_bg ) {
+		if( set_fg ) {
+			out_bytes(out,";",1);
+		}
+		screen_color(screen,bg,40,mode);
+		screen->pen_bg = bg;
+	}
+	out_bytes(out,"m",1);
+}
+
+
+//Diff every row against what the terminal shows
+void screen_rows(screen_t *screen, const uint32_t *colors) {
+	size_t x,y,i,run;
+	size_t w = screen->width;
+	size_t h = screen->height;
+	uint8_t mode = screen->color_mode;
+	uint8_t set = screen->glyph_set;
+	cell_t *cells;
+	shown_t *shown;
+	shown_t c;
+	outbuf_t *out = &screen->out;
+	
+	for( y=0; y<h; y++ ) {
+		cells = &screen->cells[y*w];
+		shown = &screen->shown[y*w];
+		//Rows whose composed cells and colors are unchanged are skipped whole
+		if( !screen->dirty[y] && !memcmp(cells,&screen->prev[y*w],w*sizeof(cell_t)) ) {
+			continue;
+		}
+		memcpy(&screen->prev[y*w],cells,w*sizeof(cell_t));
+		screen->dirty[y] = 0;
+		screen->rows_encoded++;
+		for( x=0; x<w; ) {
+			c.glyph = cells[x].glyph;
+			c.fg = colors[cells[x].fg];
+			c.bg = colors[cells[x].bg];
+			//The foreground of a blank cell is never visible
+			if( c.glyph == GLYPH_SPACE ) {
+				c.fg = COLOR_ANY;
+			}
+			if( c.glyph == shown[x].glyph && c.fg == shown[x].fg && c.bg == shown[x].bg ) {
+				x++;
+				continue;
+			}
+			
+			if( c.glyph == GLYPH_SPACE ) {
+				for( run=1; x+run<w; run++ ) {
+					if( cells[x+run].glyph != GLYPH_SPACE || colors[cells[x+run].bg] != c.bg ) {
+						break;
+					}
+				}
+				if( run >= ECH_MIN ) {
+					screen_move(screen,x,y);
+					screen_sgr(screen,c.fg,c.bg,mode);
+					out_bytes(out,"\x1b[",2);
+					out_num(out,run);
+					out_bytes(out,"X",1);
+					for( i=0; i<run; i++ ) {
+						shown[x+i] = c;
+					}
+					x = x + run;
+					continue;
+				}
+			}
+			
+			screen_move(screen,x,y);
+			screen_sgr(screen,c.fg,c.bg,mode);
+			if( set == GLYPHS_ASCII ) {
+				out->data[out->len++] = glyphs[GLYPHS_ASCII][c.glyph][0];
+			}
+			else {
+				out_bytes(out,glyphs[set][c.glyph],glyph_len[set][c.glyph]);
+			}
+			shown[x] = c;
+			screen->cur_x++;
+			//Cursor position after writing the last column is terminal dependent
+			if( screen->cur_x >= w ) {
+				screen->cur_y = SIZE_MAX;
+			}
+			x++;
+		}
+	}
+}
+
+
+int screen_update(screen_t *screen) {
+	shown_t *tmp;
+	size_t size;
+	
+	if( !screen ) {
+		return -1;
+	}
+	if( screen->term->updated || !screen->shown ) {
+		//One allocation holds the shown cells, both composed frames and the row flags
+		size = screen->term->width*screen->term->height;
+		tmp = realloc(screen->shown,(sizeof(shown_t)+2*sizeof(cell_t))*size+screen->term->height);
+		if( !tmp ) {
+			return -2;
+		}
+		screen->shown = tmp;
+		screen->width = screen->term->width;
+		screen->height = screen->term->height;
+		screen->cells = (cell_t*)(screen->shown + size);
+		screen->prev = screen->cells + size;
+		screen->dirty = (uint8_t*)(screen->prev + size);
+		screen->invalid = 1;
+	}
+	return 0;
+}
+
+
+//Re-resolve any palette entries whose RGB changed since the last frame
+//and rebuild the OSC 4 sequences used for lightning
+void screen_palette_sync(screen_t *screen) {
+	palette_t *palette = screen->palette;
+	uint8_t seen[PAL_SIZE];
+	size_t i;
+	size_t n;
+	size_t m;
+	uint32_t slot;
+	uint32_t lit;
+	uint32_t c;
+	uint8_t changed = 0;
+	
+	for( i=0; i<PAL_SIZE; i++ ) {
+		if( screen->rgb[i] != palette->rgb[i] ) {
+			screen->rgb[i] = palette->rgb[i];
+			c = color_resolve(palette->rgb[i],screen->color_mode);
+			if( c != screen->colors[i] ) {
+				screen->colors[i] = c;
+				changed = 1;
+			}
+		}
+	}
+	if( !changed ) {
+		return;
+	}
+	//Only a change in the quantized color dirties the cells using an entry
+	for( i=0; i<PAL_SIZE; i++ ) {
+		c = screen->colors[palette->flash[i]];
+		screen->changed[i] = screen->colors[i] != screen->shown_colors[i] || c != screen->flash_colors[i];
+		screen->shown_colors[i] = screen->colors[i];
+		screen->flash_colors[i] = c;
+	}
+	screen->palette_changed = 1;
+	
+	//Truecolor output does not go through the terminal palette
+	screen->flash_osc[0] = 0;
+	screen->flash_osc_reset[0] = 0;
+	if( screen->color_mode == COLORS_TRUE ) {
+		return;
+	}
+	memset(seen,0,sizeof(seen));
+	n = 0;
+	m = snprintf(screen->flash_osc_reset,sizeof(screen->flash_osc_reset),"\x1b]104");
+	for( i=0; i<PAL_SIZE; i++ ) {
+		slot = screen->colors[i];
+		lit = palette->rgb[palette->flash[i]];
+		if( palette->flash[i] == i || slot == COLOR_DEFAULT || lit == COLOR_DEFAULT || seen[slot] ) {
+			continue;
+		}
+		if( n + 64 >= sizeof(screen->flash_osc) || m + 8 >= sizeof(screen->flash_osc_reset) ) {
+			break;
+		}
+		seen[slot] = 1;
+		n += snprintf(screen->flash_osc+n,sizeof(screen->flash_osc)-n,"%s%u;rgb:%02x/%02x/%02x",
+			n ? ";" : "\x1b]4;",slot,(lit>>16)&0xff,(lit>>8)&0xff,lit&0xff);
+		m += snprintf(screen->flash_osc_reset+m,sizeof(screen->flash_osc_reset)-m,";%u",slot);
+	}
+	if( n ) {
+		n += snprintf(screen->flash_osc+n,sizeof(screen->flash_osc)-n,"\x1b\\");
+	}
+	//The default background is redefined with OSC 11
+	lit = palette->rgb[palette->flash[PAL_DEFAULT]];
+	if( lit != COLOR_DEFAULT ) {
+		snprintf(screen->flash_osc+n,sizeof(screen->flash_osc)-n,"\x1b]11;rgb:%02x/%02x/%02x\x1b\\",
+			(lit>>16)&0xff,(lit>>8)&0xff,lit&0xff);
+	}
+	snprintf(screen->flash_osc_reset+m,sizeof(screen->flash_osc_reset)-m,"\x1b\\\x1b]111\x1b\\");
+}
+
+
+int screen_set_color_mode(screen_t *screen, uint8_t mode) {
+	size_t i;
+	
+	if( !screen ) {
+		return -1;
+	}
+	screen->color_mode = mode;
+	//Force every palette entry to be resolved again
+	for( i=0; i<PAL_SIZE; i++ ) {
+		screen->rgb[i] = ~screen->palette->rgb[i];
+		screen->colors[i] = COLOR_ANY;
+		screen->shown_colors[i] = COLOR_ANY;
+		screen->flash_colors[i] = COLOR_ANY;
+	}
+	screen_palette_sync(screen);
+	screen->invalid = 1;
+	return 0;
+}
+
+
+int screen_set_glyphs(screen_t *screen, uint8_t set) {
+	if( !screen ) {
+		return -1;
+	}
+	if( set >= GLYPH_SETS ) {
+		return -2;
+	}
+	screen->glyph_set = set;
+	screen->invalid = 1;
+	return 0;
+}
+
+
+int screen_init(screen_t *screen, termsize_t *term, palette_t *palette) {
+	if( !screen ) {
+		return -1;
+	}
+	if( !term ) {
+		return -2;
+	}
+	if( !palette ) {
+		return -3;
+	}
+	screen->term = term;
+	screen->palette = palette;
+	screen->cells = 0;
+	screen->shown = 0;
+	screen->flash = 0;
+	screen->flash_shown = 0;
+	screen->flash_colored = 0;
+	screen->osc_palette = 0;
+	screen->rows_encoded = 0;
+	screen->glyph_set = GLYPHS_UNICODE;
+	screen->coarse = 0;
+	screen->view_x = 0;
+	screen->view_y = 0;
+	screen->shown_view_x = 0;
+	screen->shown_view_y = 0;
+	screen->scroll_columns = 0;
+	screen->sync = 0;
+	screen->status_len = 0;
+	screen->status_shown = 0;
+	outbuf_init(&screen->out);
+	screen_set_color_mode(screen,COLORS_16);
+	return screen_update(screen);
+}
+
+
+//Look at a world of width by height cells centered and standing on the
+//bottom row
+int screen_center(screen_t *screen, size_t width, size_t height) {
+	if( !screen ) {
+		return -1;
+	}
+	screen->view_x = ((ptrdiff_t)width - (ptrdiff_t)screen->width)/2;
+	screen->view_y = (ptrdiff_t)height - (ptrdiff_t)screen->height;
+	return 0;
+}
+
+
+//Pick the richest color mode the environment advertises
+uint8_t color_mode_detect() {
+	char *colorterm = getenv("COLORTERM");
+	char *term = getenv("TERM");
+	
+	if( colorterm && (!strcmp(colorterm,"truecolor") || !strcmp(colorterm,"24bit")) ) {
+		return COLORS_TRUE;
+	}
+	if( term && strstr(term,"256color") ) {
+		return COLORS_256;
+	}
+	return COLORS_16;
+}
+
+
+//Blank the shown cells from i for n cells, as a scroll leaves them with
+//the default background
+void screen_shown_blank(screen_t *screen, size_t i, size_t n) {
+	for( n=i+n; i<n; i++ ) {
+		screen->shown[i].glyph = GLYPH_SPACE;
+		screen->shown[i].fg = COLOR_ANY;
+		screen->shown[i].bg = COLOR_DEFAULT;
+	}
+}
+
+
+//Forget what the terminal shows in the n cells from i, so that the diff
+//paints them again
+void screen_shown_forget(screen_t *screen, size_t i, size_t n) {
+	for( n=i+n; i<n; i++ ) {
+		screen->shown[i].glyph = GLYPH_COUNT;
+	}
+}
+
+
+//When the view moved, move what the terminal shows along with it so that
+//only the strip the view moved onto is painted.  Rows scroll with SU/SD
+//inside a full screen DECSTBM region, columns with SL/SR where the
+//terminal is known to have them.
+void screen_scroll(screen_t *screen) {
+	ptrdiff_t dx = screen->view_x - screen->shown_view_x;
+	ptrdiff_t dy = screen->view_y - screen->shown_view_y;
+	size_t w = screen->width;
+	size_t h = screen->height;
+	size_t n,y;
+	outbuf_t *out = &screen->out;
+	
+	if( !dx && !dy ) {
+		return;
+	}
+	screen->shown_view_x = screen->view_x;
+	screen->shown_view_y = screen->view_y;
+	n = dy < 0 ? -dy : dy;
+	if( n >= h || (dx && (!screen->scroll_columns || (size_t)(dx < 0 ? -dx : dx) >= w)) ) {
+		//Left to the diff, which repaints what differs
+		return;
+	}
+	//Scrolled in cells take the current background
+	if( screen->pen_fg != COLOR_DEFAULT || screen->pen_bg != COLOR_DEFAULT ) {
+		out_str(out,"\x1b[0m");
+		screen->pen_fg = COLOR_DEFAULT;
+		screen->pen_bg = COLOR_DEFAULT;
+	}
+	//DECSTBM homes the cursor
+	out_str(out,"\x1b[r");
+	screen->cur_y = SIZE_MAX;
+	if( dy ) {
+		out_bytes(out,"\x1b[",2);
+		out_num(out,n);
+		out_bytes(out,dy > 0 ? "S" : "T",1);
+		if( dy > 0 ) {
+			memmove(screen->shown,screen->shown+n*w,sizeof(shown_t)*(h-n)*w);
+			memmove(screen->prev,screen->prev+n*w,sizeof(cell_t)*(h-n)*w);
+			memmove(screen->dirty,screen->dirty+n,h-n);
+			screen_shown_blank(screen,(h-n)*w,n*w);
+			memset(screen->dirty+h-n,1,n);
+		}
+		else {
+			memmove(screen->shown+n*w,screen->shown,sizeof(shown_t)*(h-n)*w);
+			memmove(screen->prev+n*w,screen->prev,sizeof(cell_t)*(h-n)*w);
+			memmove(screen->dirty+n,screen->dirty,h-n);
+			screen_shown_blank(screen,0,n*w);
+			memset(screen->dirty,1,n);
+		}
+	}
+	if( dx ) {
+		n = dx < 0 ? -dx : dx;
+		out_bytes(out,"\x1b[",2);
+		out_num(out,n);
+		out_str(out,dx > 0 ? " @" : " A");
+		for( y=0; y<h; y++ ) {
+			if( dx > 0 ) {
+				memmove(screen->shown+y*w,screen->shown+y*w+n,sizeof(shown_t)*(w-n));
+				screen_shown_blank(screen,y*w+w-n,n);
+			}
+			else {
+				memmove(screen->shown+y*w+n,screen->shown+y*w,sizeof(shown_t)*(w-n));
+				screen_shown_blank(screen,y*w,n);
+			}
+		}
+		//Every row lost its prev columns, the diff against shown decides
+		memset(screen->dirty,1,h);
+	}
+}
+
+
+//Append the escape sequences that bring the terminal from the shown cells
+//to the composed cells.  Only cells whose glyph or resolved color differ
+//are emitted.
+int screen_encode(screen_t *screen) {
+	size_t x,y,i;
+	size_t w,h;
+	size_t start;
+	cell_t *cells;
+	uint32_t *colors;
+	outbuf_t *out;
+	
+	if( !screen ) {
+		return -1;
+	}
+	out = &screen->out;
+	w = screen->width;
+	h = screen->height;
+	if( outbuf_reserve(out,w*h*ENCODE_CELL_MAX+ENCODE_SLACK) ) {
+		return -2;
+	}
+	//The terminal holds what follows until the frame ends, so a large
+	//change is shown at once rather than as it arrives
+	start = out->len;
+	if( screen->sync ) {
+		out_str(out,SYNC_BEGIN);
+	}
+	screen_palette_sync(screen);
+	
+	if( screen->invalid ) {
+		out_str(out,"\x1b[0m\x1b[2J");
+		screen->pen_fg = COLOR_DEFAULT;
+		screen->pen_bg = COLOR_DEFAULT;
+		screen->cur_y = SIZE_MAX;
+		for( i=0; i<w*h; i++ ) {
+			screen->shown[i].glyph = GLYPH_SPACE;
+			screen->shown[i].fg = COLOR_ANY;
+			screen->shown[i].bg = COLOR_DEFAULT;
+		}
+		memset(screen->dirty,1,h);
+		screen->palette_changed = 0;
+		screen->invalid = 0;
+		screen->shown_view_x = screen->view_x;
+		screen->shown_view_y = screen->view_y;
+		screen->status_shown = 0;
+	}
+	//The status line is not in shown, so the cells it leaves are painted
+	//again, and so is wherever a scroll takes it
+	w = w < screen->status_len ? w : screen->status_len;
+	if( screen->status_shown > w || 
+			(screen->status_shown && (screen->view_x != screen->shown_view_x || 
+			screen->view_y != screen->shown_view_y)) ) {
+		screen_shown_forget(screen,0,screen->status_shown);
+		screen->dirty[0] = 1;
+	}
+	w = screen->width;
+	screen_scroll(screen);
+	
+	//Terminals that accept palette redefinition flash with one sequence
+	if( screen->osc_palette && screen->color_mode != COLORS_TRUE ) {
+		if( screen->flash != screen->flash_shown ) {
+			out_str(out,screen->flash ? screen->flash_osc : screen->flash_osc_reset);
+			screen->flash_shown = screen->flash;
+		}
+		colors = screen->colors;
+	}
+	else if( screen->flash ) {
+		colors = screen->flash_colors;
+	}
+	else {
+		colors = screen->colors;
+	}
+	if( (colors == screen->flash_colors) != screen->flash_colored ) {
+		screen->flash_colored = colors == screen->flash_colors;
+		memset(screen->dirty,1,h);
+	}
+	//Rows holding a palette entry whose resolved color changed
+	if( screen->palette_changed ) {
+		for( y=0; y<h; y++ ) {
+			cells = &screen->cells[y*w];
+			for( x=0; x<w && !screen->dirty[y]; x++ ) {
+				screen->dirty[y] = screen->changed[cells[x].fg] | screen->changed[cells[x].bg];
+			}
+		}
+		screen->palette_changed = 0;
+	}
+	
+	screen_rows(screen,colors);
+	
+	screen->status_shown = screen->status_len < w ? screen->status_len : w;
+	if( screen->status_shown && h ) {
+		out_str(out,"\x1b[1;1H\x1b[0;7m");
+		out_bytes(out,screen->status,screen->status_shown);
+		out_str(out,"\x1b[0m");
+		screen->pen_fg = COLOR_DEFAULT;
+		screen->pen_bg = COLOR_DEFAULT;
+		screen->cur_y = SIZE_MAX;
+	}
+	if( screen->pen_fg != COLOR_DEFAULT || screen->pen_bg != COLOR_DEFAULT ) {
+		out_str(out,"\x1b[0m");
+		screen->pen_fg = COLOR_DEFAULT;
+		screen->pen_bg = COLOR_DEFAULT;
+	}
+	if( screen->sync ) {
+		//A frame with nothing in it sends nothing
+		if( out->len == start+strlen(SYNC_BEGIN) ) {
+			out->len = start;
+		}
+		else {
+			out_str(out,SYNC_END);
+		}
+	}
+	return 0;
+}
+
+
+uint8_t island_color(water_t *water, size_t x, size_t y) {
+	size_t mid = water->term->width/2;
+	size_t top = water->island_y;
+	size_t reach;
+	
+	if( y == top-5 && (x==mid-3 || x==mid-1 || x==mid+1) ) {
+		return PAL_GRASS;
+	}
+	if( y == top-4 && x+2>=mid && x<=mid ) {
+		return PAL_GRASS;
+	}
+	if( y == top-3 && (x==mid-3 || x==mid+1) ) {
+		return PAL_GRASS;
+	}
+	if( y == top-3 && x==mid-1 ) {
+		return PAL_TRUNK;
+	}
+	if( (y == top-2 || y == top-1) && x==mid ) {
+		return PAL_TRUNK;
+	}
+	if( y >= top ) {
+		reach = 1+2*(y-top);
+		if( x+reach >= mid && x <= mid+reach ) {
+			return PAL_SAND;
+		}
+	}
+	return PAL_DEFAULT;
+}
+
+
+//Start from nothing: no sprites, layers, island or systems
+void scene_clear(scene_t *scene) {
+	size_t i;
+	
+	scene->sprite_count = 0;
+	scene->layer_count = 0;
+	scene->cell_count = 0;
+	scene->span_count = 0;
+	scene->param_count = 0;
+	scene->cloud = SCENE_SPRITES;
+	scene->island = 0;
+	scene->systems = 0;
+	scene->day = 0;
+	scene->line = 0;
+	for( i=0; i<SCENE_KEYS; i++ ) {
+		scene->keys[i].glyph = GLYPH_NONE;
+		scene->keys[i].fg = PAL_DEFAULT;
+		scene->keys[i].bg = PAL_DEFAULT;
+	}
+	for( i=0; i<PAL_FLASH_SKY; i++ ) {
+		scene->colors[i] = COLOR_ANY;
+	}
+	//Composed again at the next render
+	scene->backdrop_width = 0;
+	scene->backdrop_height = 0;
+}
+
+
+//Whether drips fall from the cloud, which needs both running
+int scene_rains(const scene_t *scene) {
+	return (scene->systems & (SCENE_CLOUD|SCENE_RAIN)) == (SCENE_CLOUD|SCENE_RAIN);
+}
+
+
+int scene_sprite(scene_t *scene, const char *name) {
+	size_t i;
+	
+	for( i=0; i<scene->sprite_count; i++ ) {
+		if( !strcmp(scene->sprites[i].name,name) ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+int scene_name(const char *names[], size_t count, const char *name) {
+	size_t i;
+	
+	for( i=0; i<count; i++ ) {
+		if( names[i] && !strcmp(names[i],name) ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+int scene_number(const char *text, long *value) {
+	char *end;
+	
+	*value = strtol(text,&end,10);
+	return end == text || *end ? -1 : 0;
+}
+
+
+//Cut each sprite row into spans of cells that are drawn, split where the
+//cells go from having a background to letting it through
+int scene_atlas(scene_t *scene) {
+	sprite_t *sprite;
+	span_t *span;
+	cell_t *row;
+	size_t i,x,y,start;
+	uint8_t solid;
+	
+	scene->span_count = 0;
+	for( i=0; i<scene->sprite_count; i++ ) {
+		sprite = &scene->sprites[i];
+		sprite->span = scene->span_count;
+		for( y=0; y<sprite->height; y++ ) {
+			row = &scene->cells[sprite->offset + y*sprite->width];
+			for( x=0; x<sprite->width; ) {
+				if( row[x].glyph == GLYPH_NONE ) {
+					x++;
+					continue;
+				}
+				solid = row[x].bg != PAL_DEFAULT;
+				for( start=x; x<sprite->width && row[x].glyph != GLYPH_NONE && (row[x].bg != PAL_DEFAULT) == solid; x++ );
+				if( scene->span_count == SCENE_SPANS ) {
+					return -1;
+				}
+				span = &scene->spans[scene->span_count++];
+				span->x = start;
+				span->y = y;
+				span->len = x - start;
+				span->solid = solid;
+			}
+		}
+		sprite->spans = scene->span_count - sprite->span;
+	}
+	return 0;
+}
+
+
+//Compile a scene from text, which is modified.  Each line is a keyword
+//and its words, # starts a comment:
+//
+//  param NAME VALUE            A parameter as in -f, under -f
+//  color NAME RRGGBB           black, water, grass, trunk, sand or cloud
+//  key C GLYPH FG BG           What character C draws in the sprites that
+//                              follow: GLYPH space, cloud or drip, FG and
+//                              BG a color or sky, which lets through what
+//                              is under the sprite
+//  sprite NAME WIDTH HEIGHT    Followed by HEIGHT rows taken as they are.
+//                              A character without a key is clear.
+//  layer SPRITE ANCHOR X Y     Stand a sprite on the backdrop, X columns
+//                              right of its place at the left, center or
+//                              right ANCHOR and Y rows up from the bottom
+//  island                      Put the built-in island under the layers
+//  cloud SPRITE                Draw the cloud as SPRITE
+//  system cloud|rain|storm...  Systems that run
+//  day SECONDS                 Day length, under -d
+int scene_parse(scene_t *scene, char *text) {
+	char *line,*next,*end;
+	char *word[SCENE_WORDS];
+	size_t words;
+	sprite_t *sprite = 0;
+	cell_t *cell;
+	size_t rows = 0;
+	size_t len,x,i;
+	long v[3];
+	int n;
+	params_t p;
+	
+	if( !scene || !text ) {
+		return -1;
+	}
+	scene_clear(scene);
+	for( line=text; line; line=next ) {
+		scene->line++;
+		next = strchr(line,'\n');
+		//A newline ends the last line rather than starting an empty one
+		if( next ) {
+			*next++ = 0;
+			next = *next ? next : 0;
+		}
+		if( rows ) {
+			len = strcspn(line,"\r");
+			cell = &scene->cells[sprite->offset + (sprite->height-rows)*sprite->width];
+			for( x=0; x<sprite->width; x++ ) {
+				cell[x] = scene->keys[x < len && (uint8_t)line[x] < SCENE_KEYS ? (uint8_t)line[x] : ' '];
+			}
+			rows--;
+			continue;
+		}
+		if( (end = strchr(line,'#')) ) {
+			*end = 0;
+		}
+		for( words=0; words<SCENE_WORDS && (word[words] = strtok(words ? 0 : line," \t\r")); words++ );
+		if( !words ) {
+			continue;
+		}
+		if( !strcmp(word[0],"param") && words == 3 ) {
+			for( i=0; i<PARAM_KEYS && strcmp(word[1],param_keys[i].name); i++ );
+			if( i == PARAM_KEYS || scene->param_count == SCENE_PARAMS ) {
+				return -4;
+			}
+			scene->param_keys[scene->param_count] = i;
+			scene->param_values[scene->param_count] = strtod(word[2],&end);
+			if( end == word[2] || *end ) {
+				return -4;
+			}
+			scene->param_count++;
+		}
+		else if( !strcmp(word[0],"color") && words == 3 ) {
+			n = scene_name(scene_colors,PAL_FLASH_SKY,word[1]);
+			if( n <= 0 || strlen(word[2]) != 6 || strspn(word[2],"0123456789abcdefABCDEF") != 6 ) {
+				return -4;
+			}
+			scene->colors[n] = strtoul(word[2],0,16);
+		}
+		else if( !strcmp(word[0],"key") && words == 5 && strlen(word[1]) == 1 && (uint8_t)word[1][0] < SCENE_KEYS ) {
+			cell = &scene->keys[(uint8_t)word[1][0]];
+			n = scene_name(scene_glyphs,GLYPH_WATER,word[2]);
+			cell->glyph = n;
+			if( n < 0 ) {
+				return -4;
+			}
+			n = scene_name(scene_colors,PAL_FLASH_SKY,word[3]);
+			cell->fg = n;
+			if( n < 0 ) {
+				return -4;
+			}
+			n = scene_name(scene_colors,PAL_FLASH_SKY,word[4]);
+			cell->bg = n;
+			if( n < 0 ) {
+				return -4;
+			}
+		}
+		else if( !strcmp(word[0],"sprite") && words == 4 ) {
+			if( scene_number(word[2],&v[0]) || scene_number(word[3],&v[1]) || v[0] < 1 || v[1] < 1 ) {
+				return -4;
+			}
+			if( scene->sprite_count == SCENE_SPRITES || strlen(word[1]) >= SCENE_NAME ||
+					scene_sprite(scene,word[1]) >= 0 || v[0]*v[1] > SCENE_CELLS - (long)scene->cell_count ) {
+				return -5;
+			}
+			sprite = &scene->sprites[scene->sprite_count++];
+			strcpy(sprite->name,word[1]);
+			sprite->width = v[0];
+			sprite->height = v[1];
+			sprite->offset = scene->cell_count;
+			scene->cell_count = scene->cell_count + v[0]*v[1];
+			rows = v[1];
+		}
+		else if( !strcmp(word[0],"layer") && words == 5 ) {
+			n = scene_sprite(scene,word[1]);
+			if( n < 0 || scene->layer_count == SCENE_LAYERS ) {
+				return -5;
+			}
+			scene->layers[scene->layer_count].sprite = n;
+			n = scene_name(layer_anchors,3,word[2]);
+			scene->layers[scene->layer_count].anchor = n;
+			if( n < 0 || scene_number(word[3],&v[0]) || scene_number(word[4],&v[1]) ) {
+				return -4;
+			}
+			scene->layers[scene->layer_count].x = v[0];
+			scene->layers[scene->layer_count].y = v[1];
+			scene->layer_count++;
+		}
+		else if( !strcmp(word[0],"island") && words == 1 ) {
+			scene->island = 1;
+		}
+		else if( !strcmp(word[0],"cloud") && words == 2 ) {
+			n = scene_sprite(scene,word[1]);
+			if( n < 0 ) {
+				return -5;
+			}
+			scene->cloud = n;
+		}
+		else if( !strcmp(word[0],"system") && words > 1 ) {
+			for( i=1; i<words; i++ ) {
+				n = scene_name(scene_systems,3,word[i]);
+				if( n < 0 ) {
+					return -4;
+				}
+				scene->systems = scene->systems | 1<<n;
+			}
+		}
+		else if( !strcmp(word[0],"day") && words == 2 ) {
+			if( scene_number(word[1],&v[0]) || v[0] < 0 ) {
+				return -4;
+			}
+			scene->day = v[0];
+		}
+		else {
+			return -4;
+		}
+	}
+	if( rows ) {
+		return -4;
+	}
+	if( scene_atlas(scene) ) {
+		return -5;
+	}
+	//Rain falls from the cloud, which needs a shape
+	if( scene->systems & (SCENE_CLOUD|SCENE_RAIN) && scene->cloud == SCENE_SPRITES ) {
+		return -5;
+	}
+	params_defaults(&p);
+	for( i=0; i<scene->param_count; i++ ) {
+		params_set(&p,param_keys[scene->param_keys[i]].name,scene->param_values[i]);
+	}
+	if( !params_valid(&p) ) {
+		return -6;
+	}
+	return 0;
+}
+
+
+int scene_load(scene_t *scene, const char *path) {
+	char text[SCENE_FILE_MAX+1];
+	int err;
+	
+	if( !scene || !path ) {
+		return -1;
+	}
+	scene->line = 0;
+	err = text_load(path,text,SCENE_FILE_MAX);
+	if( err ) {
+		return err;
+	}
+	return scene_parse(scene,text);
+}
+
+
+//The built-in scene: the island under the cloud of cloud_char, raining
+int scene_init(scene_t *scene) {
+	char text[256];
+	
+	if( !scene ) {
+		return -1;
+	}
+	scene->backdrop = 0;
+	snprintf(text,sizeof(text),"key @ cloud cloud sky\nsprite cloud 5 3\n%s\n%s\n%s\ncloud cloud\nisland\nsystem cloud rain\n",
+		cloud_char[0],cloud_char[1],cloud_char[2]);
+	return scene_parse(scene,text);
+}
+
+
+//Draw a sprite with its top left corner at x,y in a buffer of w by h
+//cells, a span at a time
+void sprite_blit(scene_t *scene, sprite_t *sprite, cell_t *cells, size_t w, size_t h, ptrdiff_t x, ptrdiff_t y) {
+	span_t *span = &scene->spans[sprite->span];
+	span_t *end = span + sprite->spans;
+	cell_t *src,*dst;
+	ptrdiff_t row,left,right;
+	size_t i,n;
+	//A see-through span keeps the bg under it: its cells are copied two
+	//to a word with the bg bytes masked out
+	const cell_t mask[2] = {{0xffff,0xff,0},{0xffff,0xff,0}};
+	uint64_t keep,word,under;
+	
+	memcpy(&keep,mask,sizeof(keep));
+	for( ; span<end; span++ ) {
+		row = y + span->y;
+		left = x + span->x;
+		right = left + span->len;
+		if( row < 0 || row >= (ptrdiff_t)h || right <= 0 || left >= (ptrdiff_t)w ) {
+			continue;
+		}
+		src = &scene->cells[sprite->offset + span->y*sprite->width + span->x];
+		if( left < 0 ) {
+			src = src - left;
+			left = 0;
+		}
+		n = (right < (ptrdiff_t)w ? right : (ptrdiff_t)w) - left;
+		dst = &cells[row*w + left];
+		if( span->solid ) {
+			memcpy(dst,src,sizeof(cell_t)*n);
+			continue;
+		}
+		for( i=0; i+2<=n; i+=2 ) {
+			memcpy(&word,&src[i],sizeof(word));
+			memcpy(&under,&dst[i],sizeof(under));
+			under = (word & keep) | (under & ~keep);
+			memcpy(&dst[i],&under,sizeof(under));
+		}
+		//An odd cell left at the end, in the first half of a word
+		if( i < n ) {
+			word = 0;
+			under = 0;
+			memcpy(&word,&src[i],sizeof(cell_t));
+			memcpy(&under,&dst[i],sizeof(cell_t));
+			under = (word & keep) | (under & ~keep);
+			memcpy(&dst[i],&under,sizeof(cell_t));
+		}
+	}
+}
+
+
+//The same a cell at a time, kept to check sprite_blit() against
+void sprite_blit_cells(scene_t *scene, sprite_t *sprite, cell_t *cells, size_t w, size_t h, ptrdiff_t x, ptrdiff_t y) {
+	cell_t *src;
+	cell_t *dst;
+	ptrdiff_t i,j;
+	
+	for( j=0; j<sprite->height; j++ ) {
+		for( i=0; i<sprite->width; i++ ) {
+			src = &scene->cells[sprite->offset + j*sprite->width + i];
+			if( src->glyph == GLYPH_NONE || y+j < 0 || y+j >= (ptrdiff_t)h || x+i < 0 || x+i >= (ptrdiff_t)w ) {
+				continue;
+			}
+			dst = &cells[(y+j)*w + x+i];
+			dst->glyph = src->glyph;
+			dst->fg = src->fg;
+			if( src->bg != PAL_DEFAULT ) {
+				dst->bg = src->bg;
+			}
+		}
+	}
+}
+
+
+//Compose the island and the layers for the world water is in.  This runs
+//when the world changes size, so a frame only copies cells from it.
+int scene_backdrop(scene_t *scene, water_t *water) {
+	size_t w = water->term->width;
+	size_t h = water->term->height;
+	sprite_t *sprite;
+	layer_t *layer;
+	cell_t *tmp;
+	ptrdiff_t left,top;
+	ptrdiff_t x,y;
+	size_t i;
+	
+	if( scene->backdrop && w == scene->backdrop_width && h == scene->backdrop_height ) {
+		return 0;
+	}
+	tmp = realloc(scene->backdrop,sizeof(cell_t)*w*h);
+	if( !tmp ) {
+		return -2;
+	}
+	scene->backdrop = tmp;
+	scene->backdrop_width = w;
+	scene->backdrop_height = h;
+	for( y=0; y<(ptrdiff_t)h; y++ ) {
+		for( x=0; x<(ptrdiff_t)w; x++ ) {
+			tmp[y*w+x].glyph = GLYPH_SPACE;
+			tmp[y*w+x].fg = PAL_DEFAULT;
+			tmp[y*w+x].bg = scene->island ? island_color(water,x,y) : PAL_DEFAULT;
+		}
+	}
+	for( i=0; i<scene->layer_count; i++ ) {
+		layer = &scene->layers[i];
+		sprite = &scene->sprites[layer->sprite];
+		left = layer->x + (layer->anchor == LAYER_LEFT ? 0 : layer->anchor == LAYER_CENTER ? 
+			(ptrdiff_t)w/2 - sprite->width/2 : (ptrdiff_t)w - sprite->width);
+		top = (ptrdiff_t)h - layer->y - sprite->height;
+		sprite_blit(scene,sprite,tmp,w,h,left,top);
+	}
+	return 0;
+}
+
+
+//Convert the column heights to integers once per frame so that shading
+//the water is integer compares and table lookups per cell
+int water_shade(water_t *water) {
+	size_t i;
+	
+	if( !water ) {
+		return -1;
+	}
+	if( water->fixed && !water->wave.nz ) {
+		for( i=0; i<water->term->width; i++ ) {
+			water->surface[i] = FIX_INT(water->fix_height[i]);
+		}
+		return 0;
+	}
+	for( i=0; i<water->term->width; i++ ) {
+		water->surface[i] = water->cols[i].height >= 0 ? (int32_t)water->cols[i].height : -1;
+	}
+	return 0;
+}
+
+
+//Compose the part of the world the screen looks at into its cells.  Only
+//the visible window is touched.
+int render( water_t *water, drips_t *drips, cloud_t *cloud, screen_t *screen ) {
+	size_t y,x,i;
+	size_t w,h;
+	ptrdiff_t ox,oy;
+	ptrdiff_t wx,wy;
+	size_t ww,wh;
+	int32_t top;
+	int32_t depth;
+	int32_t surface;
+	uint8_t sky;
+	cell_t *row;
+	cell_t *cell;
+	
+	if( !water || !drips || !cloud || !screen ) {
+		return -1;
+	}
+	if( scene_backdrop(&scene,water) ) {
+		return -2;
+	}
+	w = screen->width;
+	h = screen->height;
+	ww = water->term->width;
+	wh = water->term->height;
+	ox = screen->view_x;
+	oy = screen->view_y;
+	water_shade(water);
+	
+	for( y=0; y<h; y++ ) {
+		wy = (ptrdiff_t)y + oy;
+		//Height of the top of this row in eighths
+		top = ((ptrdiff_t)wh-wy)*8;
+		row = &screen->cells[y*w];
+		sky = PAL_SKY + (wy > 0 ? (size_t)wy : 0)*SKY_BANDS/wh;
+		for( x=0; x<w; x++ ) {
+			wx = (ptrdiff_t)x + ox;
+			if( wx >= 0 && (size_t)wx < ww && wy >= 0 && (size_t)wy < wh ) {
+				row[x] = scene.backdrop[wy*ww+wx];
+			}
+			else {
+				row[x].glyph = GLYPH_SPACE;
+				row[x].fg = PAL_DEFAULT;
+				row[x].bg = PAL_DEFAULT;
+			}
+			if( row[x].bg == PAL_DEFAULT ) {
+				row[x].bg = sky;
+			}
+			//Beyond the world's edges the sea carries on at the edge's height
+			surface = water->surface[wx < 0 ? 0 : (size_t)wx < ww ? (size_t)wx : ww-1];
+			//Completely underwater, shaded by whole rows below this column's surface
+			depth = surface - top;
+			if( depth >= 0 ) {
+				depth = depth >> 3;
+				row[x].bg = PAL_DEPTH + (depth < DEPTH_BANDS ? depth : DEPTH_BANDS-1);
+			}
+			//Water line (blue is foreground)
+			else if( depth >= -8 ) {
+				row[x].glyph = GLYPH_WATER + ((surface | (screen->coarse ? 3 : 0)) & 7);
+				row[x].fg = PAL_WATER;
+			}
+		}
+	}
+	
+	//Render Drips
+	for( i=0; i<drips->size; i++ ) {
+		if( drips->drips[i].active ) {
+			y = ((drips->term->height*8)-drips->drips[i].y)/8 - oy;
+			x = drips->drips[i].x - ox;
+			if( y < h && x < w ) {
+				cell = &screen->cells[y*w+x];
+				cell->glyph = GLYPH_DRIP;
+				cell->fg = PAL_WATER;
+			}
+		}
+	}
+	
+	//Render Cloud, the sky showing through where the sprite has no background
+	if( !(scene.systems & SCENE_CLOUD) ) {
+		return 0;
+	}
+	sprite_blit(&scene,&scene.sprites[scene.cloud],screen->cells,w,h,(ptrdiff_t)(cloud->pos/8)-ox,-oy);
+	return 0;
+}
+
+
+int drips_init(drips_t* drips, termsize_t *term) {
+	if( !drips ) {
+		return -1;
+	}
+	if( !term ) {
+		return -2;
+	}
+	drips->term = term;
+	drips->width = term->width;
+	drips->height = term->height;
+	drips->size = 0;
+	drips->drips = 0;
+	drips->fixed = 0;
+	drips->updated = 0;
+	return 0;
+}
+
+
+//Start a drip at column x, y eighths above the bottom, falling at speed
+int drips_spawn(drips_t* drips, size_t x, size_t y, float speed) {
+	size_t i;
+	drip_t *tmp;
+	
+	if( ! drips ) {
+		return -1;
+	}
+	
+	for( i=0; i<drips->size; i++ ) {
+		if( ! drips->drips[i].active ) {
+			break;
+		}
+	}
+	if( i == drips->size ) {
+		tmp = realloc(drips->drips,sizeof(drip_t)*(drips->size+1));
+		if( ! tmp ) {
+			return -2;
+		}
+		drips->drips = tmp;
+		drips->size++;
 	}
 	drips->drips[i].active = 1;
-	drips->drips[i].x = x;
-	drips->drips[i].y = (drips->term->height - 2)*8;
-	drips->drips[i].speed = 0;
+	drips->drips[i].landed = 0;
+	drips->drips[i].x = x < drips->term->width ? x : drips->term->width-1;
+	drips->drips[i].y = y;
+	drips->drips[i].speed = speed;
+	drips->drips[i].fix_y = FIX_ONE*(fix_t)y;
+	drips->drips[i].fix_speed = FIX(speed);
+	drips->updated = 1;
+	return 0;
+}
+
+
+//A drip from the cloud, two rows below the top
+int drips_generate(drips_t* drips, size_t x) {
+	if( !drips ) {
+		return -1;
+	}
+	return drips_spawn(drips,x,drips->term->height > 2 ? (drips->term->height - 2)*8 : 0,0);
+}
+
+
+//Collision pass over the live drips.  Each is checked against the surface
+//of its own column, and the impulses of those that landed are summed per
+//column before they are applied, once per column.
+int drips_collide(drips_t *drips, water_t *water) {
+	drip_t *drip;
+	size_t landed = 0;
+	size_t i,x;
+	
+	for( i=0; i<drips->size; i++ ) {
+		drip = &drips->drips[i];
+		drip->landed = 0;
+		if( !drip->active ) {
+			continue;
+		}
+		x = drip->x;
+		if( x >= water->width ) {
+			drip->active = 0;
+			continue;
+		}
+		if( drips->fixed ? drip->fix_y > water->fix_height[x] : drip->y > water->cols[x].height ) {
+			continue;
+		}
+		if( drips->fixed ) {
+			water->fix_splash[x] = water->fix_splash[x] + drip->fix_speed;
+		}
+		else {
+			water->splash[x] = water->splash[x] + drip->speed;
+		}
+		drip->active = 0;
+		drip->landed = 1;
+		landed++;
+	}
+	if( !landed ) {
+		return 0;
+	}
+	drips->updated = 1;
+	for( i=0; i<drips->size && landed; i++ ) {
+		drip = &drips->drips[i];
+		if( !drip->landed ) {
+			continue;
+		}
+		landed--;
+		x = drip->x;
+		//The first drip of a column carries the sum for all of them
+		if( drips->fixed && water->fix_splash[x] ) {
+			water->fix_speed[x] = water->fix_speed[x] + water->fix_splash[x];
+			water->fix_splash[x] = 0;
+			water_activate(water,x);
+		}
+		else if( !drips->fixed && water->splash[x] != 0 ) {
+			water->cols[x].speed = water->cols[x].speed + water->splash[x];
+			water->splash[x] = 0;
+			water_activate(water,x);
+		}
+		if( water->term->height <= 3 ) {
+			continue;
+		}
+		if( drips->fixed && water->fix_target < FIX_ONE*(fix_t)((water->term->height-3)*8) ) {
+			water->fix_target = water->fix_target + FIX(8)/(fix_t)water->term->width;
+		}
+		if( !drips->fixed && water->target_height < (water->term->height-3)*8 ) {
+			water->target_height = water->target_height + 8.0 / water->term->width;
+		}
+	}
+	return 0;
+}
+
+
+//Drips in fixed point.  Heights are truncated to whole eighths each frame
+//like the float version, which keeps its y in a size_t.
+int drips_update_fixed(drips_t* drips, water_t *water) {
+	drip_t *drip;
+	fix_t gravity = params_current()->fix_gravity;
+	size_t row;
+	size_t i;
+	
+	for( i=0; i<drips->size; i++ ) {
+		drip = &drips->drips[i];
+		if( drip->active ) {
+			row = (drip->y+7)/8;
+			drip->fix_speed = drip->fix_speed - gravity;
+			drip->fix_y = drip->fix_y + drip->fix_speed;
+			drip->fix_y = drip->fix_y < 0 ? 0 : FIX_INT(drip->fix_y)*FIX_ONE;
+			drip->y = FIX_INT(drip->fix_y);
+			drips->updated = drips->updated | ((drip->y+7)/8 != row);
+		}
+	}
+	return drips_collide(drips,water);
+}
+
+
+//Move the drips onto the world's current size.  Columns scale with the
+//width and drips above the new sky are culled.
+void drips_resize(drips_t *drips) {
+	size_t w = drips->term->width;
+	size_t h = drips->term->height;
+	size_t i;
+	drip_t *drip;
+	
+	if( w == drips->width && h == drips->height ) {
+		return;
+	}
+	//Free slots are moved too, their column is never left pointing past
+	//the water
+	for( i=0; i<drips->size; i++ ) {
+		drip = &drips->drips[i];
+		drip->x = drips->width ? drip->x*w/drips->width : 0;
+		drip->x = drip->x < w ? drip->x : w-1;
+		if( drip->y >= h*8 ) {
+			drip->active = 0;
+		}
+	}
+	drips->width = w;
+	drips->height = h;
+	drips->updated = 1;
+}
+
+
+int drips_update(drips_t* drips, water_t *water) {
+	double gravity = params_current()->frame_gravity;
+	size_t row;
+	size_t i;
+	
+	if( ! drips ) {
+		return -1;
+	}
+	if( ! water ) {
+		return -2;
+	}
+	//Drips land on the columns laid out for the current size
+	if( water_resize(water) ) {
+		return -3;
+	}
+	//Falling drips only need redrawing when they cross into another row,
+	//which render() places at the eighth rounded up
+	drips->updated = 0;
+	drips_resize(drips);
+	if( drips->fixed ) {
+		return drips_update_fixed(drips,water);
+	}
+	
+	for( i=0; i<drips->size; i++ ) {
+		if( drips->drips[i].active ) {
+			row = (drips->drips[i].y+7)/8;
+			drips->drips[i].speed = drips->drips[i].speed - gravity;
+			if( drips->drips[i].y < drips->drips[i].speed ) {
+				drips->drips[i].y = 0;
+			}
+			else {
+				drips->drips[i].y = drips->drips[i].y + drips->drips[i].speed;
+			}
+			drips->updated = drips->updated | ((drips->drips[i].y+7)/8 != row);
+		}
+	}
+	return drips_collide(drips,water);
+}
+
+
+int cloud_init(cloud_t *cloud, termsize_t *term) {
+	if( !cloud ) {
+		return -1;
+	}
+	if( !term ) {
+		return -2;
+	}
+	
+	cloud->term = term;
+	cloud->width = term->width;
+	cloud->pos = (term->width*8)/2-2;
+	cloud->speed = params_current()->frame_cloud_speed;
+	cloud->fixed = 0;
+	cloud->fix_pos = FIX_ONE*(fix_t)cloud->pos;
+	cloud->fix_speed = params_current()->fix_cloud_speed;
+	
+	cloud->drop_count = 0;
+	cloud->drop_delay = 0;
+	cloud->cell = (size_t)(cloud->pos/8);
+	cloud->updated = 1;
+	return 0;
+}
+
+
+//Columns the cloud's sprite covers
+size_t cloud_size() {
+	return scene.cloud < scene.sprite_count ? scene.sprites[scene.cloud].width : 1;
+}
+
+
+//Rightmost position in eighths, so that the whole sprite fits
+size_t cloud_right(cloud_t *cloud) {
+	return cloud->term->width > cloud_size() ? (cloud->term->width-cloud_size())*8 : 0;
+}
+
+
+//Keep the cloud over the same part of the sky when the world is resized
+void cloud_resize(cloud_t *cloud) {
+	size_t w = cloud->term->width;
+	double right = cloud_right(cloud);
+	double center;
+	
+	if( w == cloud->width ) {
+		return;
+	}
+	center = (cloud->fixed ? FIX_FLOAT(cloud->fix_pos) : cloud->pos) + cloud_size()*4;
+	cloud->pos = cloud->width ? center*w/cloud->width - cloud_size()*4 : right/2;
+	cloud->pos = cloud->pos < 0 ? 0 : cloud->pos > right ? right : cloud->pos;
+	cloud->fix_pos = FIX_ONE*(fix_t)cloud->pos;
+	cloud->width = w;
+}
+
+
+int cloud_update_fixed(cloud_t *cloud, drips_t *drips) {
+	const params_t *p = params_current();
+	fix_t right;
+	
+	right = FIX_ONE*(fix_t)cloud_right(cloud);
+	//Keep the direction, take the speed from the current parameters
+	cloud->fix_speed = cloud->fix_speed < 0 ? -p->fix_cloud_speed : p->fix_cloud_speed;
+	
+	if( random()%(cloud->term->width*8) == 0 ) {
+		cloud->fix_speed = -cloud->fix_speed;
+	}
+	
+	cloud->fix_pos = cloud->fix_pos + cloud->fix_speed;
+	if( cloud->fix_pos >= right ) {
+		cloud->fix_pos = right;
+		cloud->fix_speed = -p->fix_cloud_speed;
+	}
+	if( cloud->fix_pos <= 0 ) {
+		cloud->fix_pos = 0;
+		cloud->fix_speed = p->fix_cloud_speed;
+	}
+	cloud->pos = FIX_FLOAT(cloud->fix_pos);
+	
+	cloud->drop_count++;
+	if( cloud->drop_count >= (cloud->drop_delay ? cloud->drop_delay : p->drip_delay) ) {
+		cloud->drop_count = 0;
+		if( scene_rains(&scene) ) {
+			drips_generate(drips,FIX_INT(cloud->fix_pos)/8+cloud_size()/2);
+		}
+	}
+	cloud->updated = (size_t)(cloud->pos/8) != cloud->cell || cloud->term->updated;
+	cloud->cell = (size_t)(cloud->pos/8);
+	return 0;
+}
+
+
+int cloud_update(cloud_t *cloud, drips_t *drips) {
+	const params_t *p = params_current();
+	
+	if( !cloud ) {
+		return -1;
+	}
+	cloud_resize(cloud);
+	if( cloud->fixed ) {
+		return cloud_update_fixed(cloud,drips);
+	}
+	
+	cloud->speed = cloud->speed < 0 ? -p->frame_cloud_speed : p->frame_cloud_speed;
+	
+	if( random()%(cloud->term->width*8) == 0 ) {
+		cloud->speed = -1*cloud->speed;
+	}
+	
+	cloud->pos = cloud->pos + cloud->speed;
+	if( cloud->pos >= cloud_right(cloud) ) {
+		cloud->pos = cloud_right(cloud);
+		cloud->speed = -p->frame_cloud_speed;
+	}
+	if( cloud->pos <= 0 ) {
+		cloud->pos = 0;
+		cloud->speed = p->frame_cloud_speed;
+	}
+	
+	cloud->drop_count++;
+	if( cloud->drop_count >= (cloud->drop_delay ? cloud->drop_delay : p->drip_delay) ) {
+		cloud->drop_count = 0;
+		//A scene without rain keeps it off whatever the keys set the rate to
+		if( scene_rains(&scene) ) {
+			drips_generate(drips,(int)(cloud->pos/8.0)+cloud_size()/2);
+		}
+	}
+	//Most frames move the cloud within the same column
+	cloud->updated = (size_t)(cloud->pos/8) != cloud->cell || cloud->term->updated;
+	cloud->cell = (size_t)(cloud->pos/8);
+	return 0;
+}
+
+
+int storm_init(storm_t *storm, uint8_t enabled) {
+	if( !storm ) {
+		return -1;
+	}
+	storm->enabled = enabled;
+	storm->flash = 0;
+	storm->lit = 0;
+	storm->updated = 0;
+	return 0;
+}
+
+
+//Without a screen only storm->lit is updated, for callers that light
+//several screens
+int storm_update(storm_t *storm, screen_t *screen) {
+	if( !storm ) {
+		return -1;
+	}
+	
+	if( storm->flash ) {
+		storm->flash--;
+	}
+	else if( storm->enabled && random()%params_current()->flash_odds == 0 ) {
+		storm->flash = 4;
+	}
+	//Lit, dark, lit, dark
+	storm->updated = storm->lit != (storm->flash == 4 || storm->flash == 2);
+	storm->lit = storm->flash == 4 || storm->flash == 2;
+	if( screen ) {
+		screen->flash = storm->lit;
+	}
+	return 0;
+}
+
+
+int daynight_init(daynight_t *day, palette_t *palette, double length) {
+	if( !day ) {
+		return -1;
+	}
+	if( !palette ) {
+		return -2;
+	}
+	day->palette = palette;
+	day->length = length;
+	day->updated = 0;
+	//Follow the wall clock so that long days line up with real time
+	day->phase = length >= 1 ? (double)(time(0) % (time_t)length)/length : 0.5;
+	return 0;
+}
+
+
+//Advance the time of day and recompute the sky and water gradients.  The
+//palette only changes in 8 bit steps, so with a long day most frames leave
+//it, and therefore the screen, untouched.
+int daynight_update(daynight_t *day) {
+	palette_t *palette;
+	uint32_t before[PAL_SKY+SKY_BANDS-PAL_DEPTH];
+	uint32_t water;
+	uint32_t key[4];
+	uint32_t t;
+	size_t k;
+	size_t i;
+	double pos;
+	
+	if( !day ) {
+		return -1;
+	}
+	if( day->length <= 0 ) {
+		return 0;
+	}
+	palette = day->palette;
+	memcpy(before,&palette->rgb[PAL_DEPTH],sizeof(before));
+	water = palette->rgb[PAL_WATER];
+	day->phase = day->phase + 1.0/(params_current()->frame_rate*day->length);
+	if( day->phase >= 1.0 ) {
+		day->phase = day->phase - 1.0;
+	}
+	
+	pos = day->phase*(DAY_KEYS-1);
+	k = (size_t)pos;
+	if( k >= DAY_KEYS-1 ) {
+		k = DAY_KEYS-2;
+	}
+	t = (uint32_t)((pos-k)*1024);
+	for( i=0; i<4; i++ ) {
+		key[i] = rgb_lerp(day_keys[k][i],day_keys[k+1][i],t,1024);
+	}
+	palette_gradient(palette,PAL_SKY,SKY_BANDS,key[0],key[1]);
+	palette->rgb[PAL_WATER] = key[2];
+	palette_gradient(palette,PAL_DEPTH,DEPTH_BANDS,key[2],key[3]);
+	//Coarser steps keep truecolor from touching a row every few frames
+	for( i=0; i<SKY_BANDS; i++ ) {
+		palette->rgb[PAL_SKY+i] &= DAY_COLOR_MASK;
+	}
+	for( i=0; i<DEPTH_BANDS; i++ ) {
+		palette->rgb[PAL_DEPTH+i] &= DAY_COLOR_MASK;
+	}
+	palette->rgb[PAL_WATER] &= DAY_COLOR_MASK;
+	day->updated = water != palette->rgb[PAL_WATER] || memcmp(before,&palette->rgb[PAL_DEPTH],sizeof(before));
+	return 0;
+}
+
+
+int camera_init(camera_t *camera) {
+	if( !camera ) {
+		return -1;
+	}
+	camera->follow = 1;
+	camera->updated = 0;
+	camera->pan = 0;
+	return 0;
+}
+
+
+//Move the view by dx columns and stop following the cloud
+int camera_pan(camera_t *camera, ptrdiff_t dx) {
+	if( !camera ) {
+		return -1;
+	}
+	camera->follow = 0;
+	camera->pan = camera->pan + dx;
+	return 0;
+}
+
+
+//Point the screen at the world.  A world no wider than the screen is
+//centered; over a wider one the view follows the cloud once it leaves the
+//middle third, and never shows past the world's edges.
+int camera_update(camera_t *camera, screen_t *screen, termsize_t *world, cloud_t *cloud) {
+	ptrdiff_t x,y;
+	ptrdiff_t w,ww;
+	ptrdiff_t c;
+	
+	if( !camera || !screen || !world || !cloud ) {
+		return -1;
+	}
+	w = screen->width;
+	ww = world->width;
+	x = screen->view_x + camera->pan;
+	y = (ptrdiff_t)world->height - (ptrdiff_t)screen->height;
+	camera->pan = 0;
+	if( ww <= w ) {
+		x = (ww-w)/2;
+	}
+	else {
+		if( camera->follow ) {
+			c = cloud->cell + cloud_size()/2;
+			if( c < x + w/3 ) {
+				x = c - w/3;
+			}
+			else if( c >= x + w - w/3 ) {
+				x = c - (w - w/3) + 1;
+			}
+		}
+		x = x < 0 ? 0 : x > ww-w ? ww-w : x;
+	}
+	camera->updated = x != screen->view_x || y != screen->view_y;
+	screen->view_x = x;
+	screen->view_y = y;
+	return 0;
+}
+
+
+//Write a control sequence straight to the terminal, outside any frame
+void tty_write(const char *s) {
+	outbuf_t out;
+	
+	out.data = (char*)s;
+	out.len = strlen(s);
+	out.size = out.len;
+	outbuf_flush(&out,STDOUT_FILENO);
+}
+
+
+//Take the terminal: stdin in raw mode when it is one, and when stdout is
+//one the alternate screen with the cursor hidden and mouse reporting.
+//Reads never block since VMIN and VTIME are 0, and stdin is left in
+//blocking mode as it may share its file with stdout.
+int input_enter(input_t *input) {
+	struct termios raw;
+	
+	if( !input ) {
+		return -1;
+	}
+	if( input->entered ) {
+		return 0;
+	}
+	if( input->raw ) {
+		raw = input->saved;
+		raw.c_iflag &= ~(IXON|ICRNL|INLCR|IGNCR|ISTRIP|BRKINT);
+		//Ctrl-C and Ctrl-Z arrive as keys
+		raw.c_lflag &= ~(ICANON|ECHO|ISIG|IEXTEN);
+		raw.c_cc[VMIN] = 0;
+		raw.c_cc[VTIME] = 0;
+		if( tcsetattr(STDIN_FILENO,TCSAFLUSH,&raw) ) {
+			return -2;
+		}
+	}
+	if( input->alternate ) {
+		tty_write("\x1b[?1049h\x1b[?25l\x1b[?1000h\x1b[?1006h");
+	}
+	input->entered = 1;
+	return 0;
+}
+
+
+//Give the terminal back as it was found.  Only write() and tcsetattr()
+//are used so the signal handlers can call it.
+int input_restore(input_t *input) {
+	if( !input ) {
+		return -1;
+	}
+	if( !input->entered ) {
+		return 0;
+	}
+	input->entered = 0;
+	//A frame cut short may have left the terminal holding its output
+	if( input->alternate ) {
+		tty_write("\x1b[?2026l\x1b[?1006l\x1b[?1000l\x1b[0m\x1b[?25h\x1b[?1049l");
+		//Cut short during a flash, the palette and background stay lit
+		if( input->osc_palette ) {
+			tty_write("\x1b]104\x1b\\\x1b]111\x1b\\");
+		}
+	}
+	if( input->raw ) {
+		tcsetattr(STDIN_FILENO,TCSADRAIN,&input->saved);
+	}
+	return 0;
+}
+
+
+void input_exit(void) {
+	input_restore(input_tty);
+}
+
+
+//Stopped or killed, the terminal is given back first.  The signal is then
+//raised again with its default action, which runs once this returns.
+void input_signal(int sig) {
+	int saved = errno;
+	
+	input_restore(input_tty);
+	signal(sig,SIG_DFL);
+	raise(sig);
+	errno = saved;
+}
+
+
+//Continued after a stop, the terminal is taken again and redrawn
+void input_continue(int sig) {
+	int saved = errno;
+	
+	(void)sig;
+	input_enter(input_tty);
+	signal(SIGTSTP,input_signal);
+	input_resumed = 1;
+	errno = saved;
+}
+
+
+//The terminal is given back on exit, on the usual signals to end, and
+//while stopped.  SIGHUP already taken to reread the parameters is left.
+int input_init(input_t *input) {
+	struct sigaction hup;
+	
+	if( !input ) {
+		return -1;
+	}
+	input->raw = isatty(STDIN_FILENO) && !tcgetattr(STDIN_FILENO,&input->saved);
+	input->alternate = isatty(STDOUT_FILENO);
+	input->entered = 0;
+	input->quit = 0;
+	input->paused = 0;
+	input->acted = 0;
+	input->osc_palette = 0;
+	input->len = 0;
+	if( input_enter(input) ) {
+		return -2;
+	}
+	input_tty = input;
+	atexit(input_exit);
+	signal(SIGINT,input_signal);
+	signal(SIGTERM,input_signal);
+	signal(SIGTSTP,input_signal);
+	signal(SIGCONT,input_continue);
+	if( !sigaction(SIGHUP,0,&hup) && hup.sa_handler == SIG_DFL ) {
+		signal(SIGHUP,input_signal);
+	}
+	return 0;
+}
+
+
+//Send the cloud left (dir < 0) or right at the current speed
+void cloud_steer(cloud_t *cloud, int dir) {
+	cloud->speed = dir < 0 ? -params_current()->frame_cloud_speed : params_current()->frame_cloud_speed;
+	cloud->fix_speed = dir < 0 ? -params_current()->fix_cloud_speed : params_current()->fix_cloud_speed;
+}
+
+
+void input_key(input_t *input, char c, cloud_t *cloud, camera_t *camera) {
+	size_t delay;
+	
+	input->acted = 1;
+	switch( c ) {
+		case 'q':
+		case 'Q':
+		case 3:
+			input->quit = 1;
+			return;
+		case 26:
+			raise(SIGTSTP);
+			return;
+	}
+	//The viewers (-C, -V) have no world of their own to act on
+	if( !cloud || !camera ) {
+		return;
+	}
+	delay = cloud->drop_delay ? cloud->drop_delay : params_current()->drip_delay;
+	switch( c ) {
+		case ' ':
+		case 'p':
+			input->paused = !input->paused;
+			break;
+		case 'h':
+			cloud_steer(cloud,-1);
+			break;
+		case 'l':
+			cloud_steer(cloud,1);
+			break;
+		case '+':
+		case '=':
+			cloud->drop_delay = delay > 1 ? delay/2 : 1;
+			break;
+		case '-':
+			cloud->drop_delay = delay*2 < RAIN_DELAY_MAX ? delay*2 : RAIN_DELAY_MAX;
+			break;
+		case '0':
+			cloud->drop_delay = 0;
+			break;
+		case ',':
+		case '<':
+			camera_pan(camera,-1);
+			break;
+		case '.':
+		case '>':
+			camera_pan(camera,1);
+			break;
+		case 'f':
+			camera->follow = 1;
+			break;
+	}
+}
+
+
+//A left click at 1-based screen cell x,y drops a drip there, or splashes
+//the surface when the pointer is under it
+void input_click(size_t x, size_t y, screen_t *screen, drips_t *drips, water_t *water) {
+	ptrdiff_t wx = screen->view_x + (ptrdiff_t)x - 1;
+	ptrdiff_t wy = screen->view_y + (ptrdiff_t)y - 1;
+	size_t height;
+	float surface;
+	
+	if( wx < 0 || (size_t)wx >= water->width || wy < 0 || (size_t)wy >= water->height ) {
+		return;
+	}
+	height = (water->height - wy)*8;
+	surface = drips->fixed ? FIX_FLOAT(water->fix_height[wx]) : water->cols[wx].height;
+	if( height <= surface ) {
+		drips_spawn(drips,wx,surface > 0 ? (size_t)surface : 0,SPLASH_SPEED);
+	}
+	else {
+		drips_spawn(drips,wx,height,0);
+	}
+}
+
+
+//Act on whatever arrived on stdin since the last frame.  A sequence cut
+//short waits in input->buf for the rest.
+int input_update(input_t *input, screen_t *screen, drips_t *drips, cloud_t *cloud, water_t *water,
+		camera_t *camera) {
+	unsigned b,x,y;
+	char final;
+	ssize_t n;
+	size_t i,j;
+	
+	if( !input ) {
+		return -1;
+	}
+	if( !input->raw ) {
+		return 0;
+	}
+	for(;;) {
+		if( input->len == INPUT_BUF ) {
+			//Nothing this long is understood
+			input->len = 0;
+		}
+		n = read(STDIN_FILENO,input->buf+input->len,INPUT_BUF-input->len);
+		if( n <= 0 ) {
+			break;
+		}
+		input->len += n;
+	}
+	for( i=0; i<input->len; ) {
+		if( input->buf[i] != 0x1b ) {
+			input_key(input,input->buf[i],cloud,camera);
+			i++;
+			continue;
+		}
+		if( i+1 >= input->len ) {
+			break;
+		}
+		if( input->buf[i+1] != '[' && input->buf[i+1] != 'O' && input->buf[i+1] != 'P' ) {
+			//Alt and a key, or a lone escape and the key after it
+			i++;
+			continue;
+		}
+		if( i+2 >= input->len ) {
+			break;
+		}
+		if( input->buf[i+1] == 'P' ) {
+			//DCS up to ST, a probe reply that came too late
+			for( j=i+2; j+1<input->len && (input->buf[j] != 0x1b || input->buf[j+1] != '\\'); j++ );
+			if( j+1 >= input->len ) {
+				break;
+			}
+			i = j+2;
+			continue;
+		}
+		//CSI or SS3 up to its final byte
+		for( j=i+2; j<input->len && (input->buf[j] < 0x40 || input->buf[j] > 0x7e); j++ );
+		if( j == input->len ) {
+			break;
+		}
+		final = input->buf[j];
+		if( input->buf[i+2] == '<' && (final == 'M' || final == 'm') ) {
+			//SGR mouse: button;column;row, M on press and m on release
+			if( sscanf(input->buf+i+3,"%u;%u;%u",&b,&x,&y) == 3 && final == 'M' && b == 0 && drips ) {
+				input_click(x,y,screen,drips,water);
+				input->acted = 1;
+			}
+		}
+		else if( final == 'D' && cloud ) {
+			cloud_steer(cloud,-1);
+			input->acted = 1;
+		}
+		else if( final == 'C' && cloud ) {
+			cloud_steer(cloud,1);
+			input->acted = 1;
+		}
+		i = j+1;
+	}
+	memmove(input->buf,input->buf+i,input->len-i);
+	input->len = input->len - i;
+	return 0;
+}
+
+
+//Set the next frame to be drawn usec from now
+int input_due(input_t *input, size_t usec) {
+	if( !input ) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC,&input->due);
+	input->due.tv_sec += usec/1000000;
+	input->due.tv_nsec += usec%1000000*1000;
+	if( input->due.tv_nsec >= 1000000000 ) {
+		input->due.tv_sec++;
+		input->due.tv_nsec -= 1000000000;
+	}
+	return 0;
+}
+
+
+//Bring the next frame in to at most usec from now
+int input_hurry(input_t *input, size_t usec) {
+	struct timespec due;
+	
+	if( !input ) {
+		return -1;
+	}
+	due = input->due;
+	input_due(input,usec);
+	if( due.tv_sec < input->due.tv_sec || (due.tv_sec == input->due.tv_sec && due.tv_nsec < input->due.tv_nsec) ) {
+		input->due = due;
+	}
+	return 0;
+}
+
+
+//Wait until the frame set by input_due is due.  Returns 1 when there is
+//input to handle first, after which the wait goes on to the same time.
+int input_wait(input_t *input) {
+	struct timespec now;
+	struct pollfd pfd;
+	int64_t usec;
+	
+	if( !input ) {
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	usec = (int64_t)(input->due.tv_sec - now.tv_sec)*1000000 + (input->due.tv_nsec - now.tv_nsec)/1000;
+	if( usec <= 0 ) {
+		return 0;
+	}
+	if( !input->raw ) {
+		usleep(usec);
+		return 0;
+	}
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	if( poll(&pfd,1,(usec+999)/1000) > 0 && (pfd.revents & POLLIN) ) {
+		return 1;
+	}
+	return 0;
+}
+
+
+//Parameters of the first reply in buf that opens with lead and ends in
+//final after digits and semicolons, or 0 while there is none
+char *caps_reply(char *buf, const char *lead, char final) {
+	char *p = buf;
+	char *q;
+	
+	while( (p = strstr(p,lead)) ) {
+		p = p + strlen(lead);
+		for( q=p; (*q >= '0' && *q <= '9') || *q == ';'; q++ );
+		if( *q == final ) {
+			return p;
+		}
+	}
+	return 0;
+}
+
+
+//Ask the terminal what it has and wait up to CAPS_TIMEOUT ms for the
+//answers.  Every terminal answers DA1, so it goes last and its reply
+//ends the wait.  Anything typed meanwhile is dropped, and so are replies
+//that come too late, or they would be read as keys.  Nothing answers
+//for SL/SR, so scroll_columns is left as it was.
+int caps_probe(caps_t *caps) {
+	char buf[CAPS_REPLY+1];
+	struct termios saved,raw;
+	struct timespec start,now;
+	struct pollfd pfd;
+	size_t len = 0;
+	ssize_t n;
+	long left;
+	char *p;
+	
+	if( !caps ) {
+		return -1;
+	}
+	if( tcgetattr(STDIN_FILENO,&saved) ) {
+		return -2;
+	}
+	raw = saved;
+	raw.c_lflag &= ~(ICANON|ECHO);
+	raw.c_cc[VMIN] = 0;
+	raw.c_cc[VTIME] = 0;
+	if( tcsetattr(STDIN_FILENO,TCSANOW,&raw) ) {
+		return -3;
+	}
+	//XTGETTCAP for RGB and Tc, DECRQM for synchronized output, DA1
+	tty_write("\x1bP+q524742\x1b\\\x1bP+q5463\x1b\\\x1b[?2026$p\x1b[c");
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	pfd.fd = STDIN_FILENO;
+	pfd.events = POLLIN;
+	buf[0] = 0;
+	while( len < CAPS_REPLY && !caps_reply(buf,"\x1b[?",'c') ) {
+		clock_gettime(CLOCK_MONOTONIC,&now);
+		left = CAPS_TIMEOUT - ((now.tv_sec-start.tv_sec)*1000 + (now.tv_nsec-start.tv_nsec)/1000000);
+		if( left <= 0 || poll(&pfd,1,left) <= 0 ) {
+			break;
+		}
+		n = read(STDIN_FILENO,buf+len,CAPS_REPLY-len);
+		if( n <= 0 ) {
+			break;
+		}
+		len = len + n;
+		buf[len] = 0;
+	}
+	tcsetattr(STDIN_FILENO,TCSANOW,&saved);
+	tcflush(STDIN_FILENO,TCIFLUSH);
+	
+	caps->colors = strstr(buf,"\x1bP1+r524742") || strstr(buf,"\x1bP1+r5463") ? COLORS_TRUE : COLORS_16;
+	//Set (1) or reset (2) means it is there, 0 and 4 that it is not
+	p = caps_reply(buf,"\x1b[?2026;",'$');
+	caps->sync = p && (atoi(p) == 1 || atoi(p) == 2);
+	return 0;
+}
+
+
+//Cached capabilities live in $XDG_CACHE_HOME/island (or ~/.cache/island),
+//one file per TERM
+int caps_path(char *path, size_t size) {
+	char *cache = getenv("XDG_CACHE_HOME");
+	char *home = getenv("HOME");
+	char *term = getenv("TERM");
+	char dir[CAPS_PATH];
+	size_t i,n;
+	
+	if( cache && *cache ) {
+		n = snprintf(dir,sizeof(dir),"%s/island",cache);
+	}
+	else if( home && *home ) {
+		n = snprintf(dir,sizeof(dir),"%s/.cache/island",home);
+	}
+	else {
+		return -1;
+	}
+	if( n >= sizeof(dir) ) {
+		return -2;
+	}
+	n = snprintf(path,size,"%s/%s",dir,term && *term ? term : "unknown");
+	if( n >= size ) {
+		return -2;
+	}
+	//TERM names a file, not a path
+	for( i=strlen(dir)+1; path[i]; i++ ) {
+		if( path[i] == '/' ) {
+			path[i] = '_';
+		}
+	}
+	return 0;
+}
+
+
+//Read key=value lines written by caps_save()
+int caps_load(caps_t *caps, const char *path) {
+	char text[CAPS_REPLY+1];
+	unsigned colors,sync,scroll_columns;
+	ssize_t n;
+	int fd;
+	
+	fd = open(path,O_RDONLY);
+	if( fd < 0 ) {
+		return -1;
+	}
+	n = read(fd,text,CAPS_REPLY);
+	close(fd);
+	if( n <= 0 ) {
+		return -2;
+	}
+	text[n] = 0;
+	if( sscanf(text,"colors=%u\nsync=%u\nscroll_columns=%u",&colors,&sync,&scroll_columns) != 3 ||
+			colors > COLORS_TRUE ) {
+		return -3;
+	}
+	caps->colors = colors;
+	caps->sync = sync != 0;
+	caps->scroll_columns = scroll_columns != 0;
+	return 0;
+}
+
+
+//Write through a temporary file so a reader never sees half of one
+int caps_save(caps_t *caps, const char *path) {
+	char tmp[CAPS_PATH+16];
+	char text[CAPS_REPLY];
+	char *slash;
+	size_t len;
+	int fd;
+	
+	snprintf(tmp,sizeof(tmp),"%s",path);
+	//Make the cache directory and its parent, which may not exist yet
+	slash = strrchr(tmp,'/');
+	*slash = 0;
+	slash = strrchr(tmp,'/');
+	*slash = 0;
+	mkdir(tmp,0700);
+	*slash = '/';
+	mkdir(tmp,0700);
+	snprintf(tmp,sizeof(tmp),"%s.%d",path,(int)getpid());
+	len = snprintf(text,sizeof(text),"colors=%u\nsync=%u\nscroll_columns=%u\n",
+		caps->colors,caps->sync,caps->scroll_columns);
+	fd = open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0600);
+	if( fd < 0 ) {
+		return -1;
+	}
+	if( write(fd,text,len) != (ssize_t)len || close(fd) || rename(tmp,path) ) {
+		unlink(tmp);
+		return -2;
+	}
+	return 0;
+}
+
+
+//What the terminal on stdin and stdout supports, from the cache when an
+//earlier run probed this TERM, or probed now.  Not on a terminal, nothing
+//beyond the defaults is assumed.
+int caps_init(caps_t *caps, uint8_t reprobe) {
+	char path[CAPS_PATH];
+	int cached;
+	
+	if( !caps ) {
+		return -1;
+	}
+	caps->colors = COLORS_16;
+	caps->sync = 0;
+	caps->scroll_columns = 0;
+	if( !isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO) ) {
+		return 0;
+	}
+	cached = !caps_path(path,sizeof(path));
+	if( cached && !caps_load(caps,path) && !reprobe ) {
+		return 0;
+	}
+	//scroll_columns=1 put in the cache by hand outlives -p
+	if( caps_probe(caps) ) {
+		return -2;
+	}
+	if( cached ) {
+		caps_save(caps,path);
+	}
+	return 0;
+}
+
+
+int pacer_init(pacer_t *pacer) {
+	if( !pacer ) {
+		return -1;
+	}
+	pacer->idle = 0;
+	pacer->steps = 1;
+	return 0;
+}
+
+
+//Back off while nothing is drawn and return to the full frame rate as soon
+//as something is
+int pacer_update(pacer_t *pacer, uint8_t drawn) {
+	if( !pacer ) {
+		return -1;
+	}
+	if( drawn ) {
+		pacer->idle = 0;
+		pacer->steps = 1;
+	}
+	else if( ++pacer->idle >= IDLE_WAKEUPS && pacer->steps < IDLE_STEPS_MAX ) {
+		pacer->idle = 0;
+		pacer->steps = pacer->steps*2;
+	}
+	return 0;
+}
+
+
+int governor_init(governor_t *gov, size_t budget, screen_t *screen) {
+	if( !gov ) {
+		return -1;
+	}
+	if( !screen ) {
+		return -2;
+	}
+	memset(gov,0,sizeof(governor_t));
+	gov->budget = budget;
+	gov->tokens = budget*GOVERNOR_DEPTH;
+	gov->mode = screen->color_mode;
+	gov->glyph_set = screen->glyph_set;
+	return 0;
+}
+
+
+//Whether a changed frame may be drawn now.  The bucket may go negative by
+//one frame, which is then paid back before the next.
+uint8_t governor_allow(governor_t *gov) {
+	if( gov->budget && gov->tokens < 0 ) {
+		gov->dropped++;
+		gov->window_dropped++;
+		return 0;
+	}
+	return 1;
+}
+
+
+void governor_apply(governor_t *gov, screen_t *screen) {
+	uint8_t mode = gov->mode;
+	uint8_t set = gov->level >= 4 ? GLYPHS_ASCII : gov->glyph_set;
+	
+	if( gov->level >= 1 && mode > COLORS_256 ) {
+		mode = COLORS_256;
+	}
+	if( gov->level >= 2 ) {
+		mode = COLORS_16;
+	}
+	if( mode != screen->color_mode ) {
+		screen_set_color_mode(screen,mode);
+	}
+	if( set != screen->glyph_set ) {
+		screen_set_glyphs(screen,set);
+	}
+	screen->coarse = gov->level >= 3;
+}
+
+
+//Account for a wakeup of steps frames that wrote bytes, and once a second
+//of frames has passed, shed a feature if frames were held back or restore
+//one if the link has room to spare
+int governor_update(governor_t *gov, screen_t *screen, size_t bytes, size_t steps) {
+	const params_t *p = params_current();
+	
+	if( !gov ) {
+		return -1;
+	}
+	if( bytes ) {
+		gov->bytes = gov->bytes + bytes;
+		gov->frames++;
+		gov->frame_bytes = bytes;
+		gov->frame_max = bytes > gov->frame_max ? bytes : gov->frame_max;
+		gov->window_bytes = gov->window_bytes + bytes;
+		gov->window_frames++;
+	}
+	gov->window_steps = gov->window_steps + steps;
+	if( gov->budget ) {
+		gov->tokens = gov->tokens + (double)gov->budget*steps/p->frame_rate - bytes;
+		gov->tokens = gov->tokens < gov->budget*GOVERNOR_DEPTH ? gov->tokens : gov->budget*GOVERNOR_DEPTH;
+	}
+	if( gov->window_steps < p->frame_rate ) {
+		return 0;
+	}
+	gov->second_bytes = gov->window_bytes*p->frame_rate/gov->window_steps;
+	if( gov->budget && screen ) {
+		gov->calm = !gov->window_dropped && gov->second_bytes*2 < gov->budget ? gov->calm+1 : 0;
+		if( gov->window_dropped*GOVERNOR_DROP > gov->window_frames+gov->window_dropped &&
+				gov->level < GOVERNOR_LEVELS-1 ) {
+			gov->level++;
+			governor_apply(gov,screen);
+		}
+		else if( gov->calm >= GOVERNOR_CALM && gov->level > 0 ) {
+			gov->level--;
+			gov->calm = 0;
+			governor_apply(gov,screen);
+		}
+	}
+	gov->window_bytes = 0;
+	gov->window_frames = 0;
+	gov->window_dropped = 0;
+	gov->window_steps = 0;
+	return 0;
+}
+
+
+//Values are fed least significant byte first so hashes match across
+//word sizes and byte orders
+uint64_t hash_u32(uint64_t hash, uint32_t v) {
+	size_t i;
+	
+	for( i=0; i<4; i++ ) {
+		hash = (hash ^ (v & 0xff)) * 0x100000001b3ULL;
+		v = v >> 8;
+	}
+	return hash;
+}
+
+
+//FNV-1a over the fixed point simulation state, identical for identical
+//runs whatever the compiler flags or architecture
+uint64_t sim_hash(water_t *water, drips_t *drips, cloud_t *cloud) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+	
+	for( i=0; i<water->term->width; i++ ) {
+		hash = hash_u32(hash,water->fix_height[i]);
+		hash = hash_u32(hash,water->fix_speed[i]);
+	}
+	hash = hash_u32(hash,water->fix_target);
+	for( i=0; i<drips->size; i++ ) {
+		if( drips->drips[i].active ) {
+			hash = hash_u32(hash,drips->drips[i].x);
+			hash = hash_u32(hash,drips->drips[i].fix_y);
+			hash = hash_u32(hash,drips->drips[i].fix_speed);
+		}
+	}
+	hash = hash_u32(hash,cloud->fix_pos);
+	hash = hash_u32(hash,cloud->fix_speed);
+	hash = hash_u32(hash,cloud->drop_count);
+	return hash;
+}
+
+
+//Set up a width by height scene with depth rows of 2D water (0 for 1D),
+//seeded the same every time
+int bench_world_init(bench_world_t *bench, size_t width, size_t height, size_t depth) {
+	if( !bench ) {
+		return -1;
+	}
+	srandom(1);
+	bench->term.width = width;
+	bench->term.height = height;
+	bench->term.updated = 1;
+	if( drips_init(&bench->drips,&bench->term) || cloud_init(&bench->cloud,&bench->term) || 
+			water_init(&bench->water,&bench->term,depth) || palette_init(&bench->palette) || 
+			screen_init(&bench->screen,&bench->term,&bench->palette) ) {
+		return -2;
+	}
+	return 0;
+}
+
+
+void bench_world_free(bench_world_t *bench) {
+	free(bench->screen.shown);
+	free(bench->screen.out.data);
+	free(bench->water.cols);
+	free(bench->drips.drips);
+}
+
+
+//Run the float and the fixed point physics from the same seed, report how
+//far the water heights drift apart, and check that two fixed point runs
+//hash identically frame by frame
+int check_fixed(size_t width, size_t height, size_t frames) {
+	bench_world_t bench;
+	float *heights;
+	uint64_t *hashes;
+	size_t frame;
+	size_t i;
+	size_t worst_frame = 0;
+	size_t mismatches = 0;
+	double diff;
+	double worst = 0;
+	double total = 0;
+	uint8_t pass;
+	
+	heights = malloc(sizeof(float)*width*frames);
+	hashes = malloc(sizeof(uint64_t)*frames);
+	if( !heights || !hashes ) {
+		free(heights);
+		free(hashes);
+		return -1;
+	}
+	for( pass=0; pass<3; pass++ ) {
+		if( bench_world_init(&bench,width,height,0) ) {
+			free(heights);
+			free(hashes);
+			return -2;
+		}
+		bench.water.fixed = pass > 0;
+		bench.drips.fixed = pass > 0;
+		bench.cloud.fixed = pass > 0;
+		for( frame=0; frame<frames; frame++ ) {
+			drips_update(&bench.drips,&bench.water);
+			cloud_update(&bench.cloud,&bench.drips);
+			water_update(&bench.water);
+			bench.term.updated = 0;
+			for( i=0; i<width; i++ ) {
+				if( pass == 0 ) {
+					heights[frame*width+i] = bench.water.cols[i].height;
+					continue;
+				}
+				diff = fabs(heights[frame*width+i] - bench.water.cols[i].height);
+				if( pass == 1 && diff > worst ) {
+					worst = diff;
+					worst_frame = frame;
+				}
+				total = total + (pass == 1 ? diff : 0);
+			}
+			if( pass == 1 ) {
+				hashes[frame] = sim_hash(&bench.water,&bench.drips,&bench.cloud);
+			}
+			else if( pass == 2 && hashes[frame] != sim_hash(&bench.water,&bench.drips,&bench.cloud) ) {
+				mismatches++;
+			}
+		}
+		bench_world_free(&bench);
+	}
+	printf("fixed vs float: %zux%zu %zu frames, max height difference %.4f eighths (frame %zu), mean %.6f\n",
+		width,height,frames,worst,worst_frame,total/(width*frames));
+	printf("fixed point: Q%d.%d state hash %016llx, repeat run %s\n",32-FIX_SHIFT,FIX_SHIFT,
+		(unsigned long long)hashes[frames-1],mismatches ? "DIFFERS" : "identical");
+	free(heights);
+	free(hashes);
+	return mismatches ? -3 : 0;
+}
+
+
+//Resize the world and the screen at random, checking that the drips,
+//cloud and water stay inside the world.  Float, fixed point and 2D water
+//each get a third of the frames.  Meant to be run built with make ASAN=1.
+int fuzz_resize(size_t frames) {
+	bench_world_t bench;
+	termsize_t term;
+	camera_t camera;
+	size_t frame;
+	size_t i;
+	size_t resizes = 0;
+	size_t bad = 0;
+	uint8_t pass;
+	
+	for( pass=0; pass<3; pass++ ) {
+		if( bench_world_init(&bench,80,24,pass == 2 ? 8 : 0) || camera_init(&camera) ) {
+			return -1;
+		}
+		srandom(pass+1);
+		//The screen is sized apart from the world
+		term = bench.term;
+		bench.screen.term = &term;
+		bench.water.fixed = pass == 1;
+		bench.drips.fixed = pass == 1;
+		bench.cloud.fixed = pass == 1;
+		for( frame=0; frame<frames/3; frame++ ) {
+			//Runs of frames at one size let waves and drips build up in between
+			bench.term.updated = random()%4 == 0;
+			if( bench.term.updated ) {
+				bench.term.width = 1 + random()%300;
+				bench.term.height = 1 + random()%100;
+				resizes++;
+			}
+			term.updated = random()%4 == 0;
+			if( term.updated ) {
+				term.width = 1 + random()%250;
+				term.height = 1 + random()%80;
+			}
+			if( drips_update(&bench.drips,&bench.water) || cloud_update(&bench.cloud,&bench.drips) || 
+					water_update(&bench.water) || screen_update(&bench.screen) || 
+					camera_update(&camera,&bench.screen,&bench.term,&bench.cloud) ||
+					render(&bench.water,&bench.drips,&bench.cloud,&bench.screen) || screen_encode(&bench.screen) ) {
+				return -2;
+			}
+			bench.screen.out.len = 0;
+			for( i=0; i<bench.drips.size; i++ ) {
+				bad += bench.drips.drips[i].active && bench.drips.drips[i].x >= bench.term.width;
+			}
+			bad += bench.cloud.pos < 0 || bench.cloud.pos > cloud_right(&bench.cloud) || 
+				bench.water.width != bench.term.width;
+			for( i=0; i<bench.term.width; i++ ) {
+				bad += !isfinite(bench.water.cols[i].height) || 
+					fabsf(bench.water.cols[i].height) > bench.term.height*64.0f;
+			}
+		}
+		bench_world_free(&bench);
+	}
+	printf("resize fuzz: %zu frames, %zu world resizes, %zu bad states\n",frames/3*3,resizes,bad);
+	return bad ? -3 : 0;
+}
+
+
+double bench_now() {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+
+//Run the scene offscreen and report the bytes emitted for normal frames
+//and for lightning frames with and without OSC palette redefinition
+int bench_flash(size_t width, size_t height, size_t frames, uint8_t mode) {
+	bench_world_t bench;
+	size_t frame;
+	size_t bytes;
+	size_t normal;
+	size_t normal_count;
+	size_t lit;
+	size_t unlit;
+	uint8_t osc;
+	
+	for( osc=0; osc<2; osc++ ) {
+		if( bench_world_init(&bench,width,height,0) ) {
+			return -1;
+		}
+		screen_set_color_mode(&bench.screen,mode);
+		bench.screen.osc_palette = osc;
+		normal = 0;
+		normal_count = 0;
+		lit = 0;
+		unlit = 0;
+		for( frame=0; frame<frames; frame++ ) {
+			drips_update(&bench.drips,&bench.water);
+			cloud_update(&bench.cloud,&bench.drips);
+			water_update(&bench.water);
+			bench.term.updated = 0;
+			bench.screen.flash = frame == frames/2;
+			render(&bench.water,&bench.drips,&bench.cloud,&bench.screen);
+			if( screen_encode(&bench.screen) ) {
+				return -2;
+			}
+			bytes = bench.screen.out.len;
+			bench.screen.out.len = 0;
+			if( frame == frames/2 ) {
+				lit = bytes;
+			}
+			else if( frame == frames/2+1 ) {
+				unlit = bytes;
+			}
+			else if( frame > 0 ) {
+				normal = normal + bytes;
+				normal_count++;
+			}
+		}
+		printf("%s: %zux%zu normal frame %zu bytes, flash frame %zu bytes, restore frame %zu bytes\n",
+			osc ? "osc palette" : "palette remap",width,height,
+			normal_count ? normal/normal_count : 0,lit,unlit);
+		bench_world_free(&bench);
+	}
+	return 0;
+}
+
+
+//Time full repaints, returning seconds per frame and the bytes of one
+double bench_encode_frames(screen_t *screen, size_t frames, size_t *bytes) {
+	size_t frame;
+	double start;
+	
+	start = bench_now();
+	for( frame=0; frame<frames; frame++ ) {
+		screen->invalid = 1;
+		if( screen_encode(screen) ) {
+			return -1;
+		}
+		*bytes = screen->out.len;
+		screen->out.len = 0;
+	}
+	return (bench_now() - start)/frames;
+}
+
+
+//Encode full repaints of the scene in each color mode and glyph set, then
+//a frame where every cell changes glyph and colors
+int bench_encode(size_t width, size_t height, size_t frames) {
+	char *names[3] = {"16 color", "256 color", "truecolor"};
+	char *sets[GLYPH_SETS] = {"unicode", "ascii"};
+	bench_world_t bench;
+	size_t bytes;
+	size_t busy_bytes = 0;
+	size_t x,y;
+	cell_t *cell;
+	double scene;
+	double busy;
+	uint8_t mode;
+	uint8_t set;
+	
+	for( set=0; set<GLYPH_SETS; set++ ) {
+		for( mode=COLORS_16; mode<=COLORS_TRUE; mode++ ) {
+			if( bench_world_init(&bench,width,height,0) ) {
+				return -1;
+			}
+			screen_set_color_mode(&bench.screen,mode);
+			screen_set_glyphs(&bench.screen,set);
+			bench.term.updated = 0;
+			render(&bench.water,&bench.drips,&bench.cloud,&bench.screen);
+			scene = bench_encode_frames(&bench.screen,frames,&bytes);
+			for( y=0; y<height; y++ ) {
+				for( x=0; x<width; x++ ) {
+					cell = &bench.screen.cells[y*width+x];
+					cell->glyph = GLYPH_WATER + (x*3+y)%8;
+					cell->fg = PAL_WATER + (x+y)%5;
+					cell->bg = PAL_BLACK + (x/2+y)%6;
+				}
+			}
+			busy = bench_encode_frames(&bench.screen,frames/10,&busy_bytes);
+			if( scene < 0 || busy < 0 ) {
+				return -2;
+			}
+			printf("%s %s: %zux%zu full frame %zu bytes, %.0f frames/s, %.1f Mcells/s, %.1f MB/s; "
+				"busy frame %zu bytes, %.1f Mcells/s\n",
+				names[mode],sets[set],width,height,bytes,1/scene,width*height/scene/1e6,bytes/scene/1e6,
+				busy_bytes,width*height/busy/1e6);
+			bench_world_free(&bench);
+		}
+	}
+	return 0;
+}
+
+
+//Run a whole simulated day and report the bytes and rows encoded per
+//frame with the sky at the terminal default and with the cycle running
+int bench_daynight(size_t width, size_t height, uint8_t mode) {
+	bench_world_t bench;
+	daynight_t day;
+	size_t frame;
+	size_t frames;
+	size_t bytes;
+	uint8_t cycle;
+	
+	frames = DAY_LENGTH*params_current()->frame_rate;
+	for( cycle=0; cycle<2; cycle++ ) {
+		if( bench_world_init(&bench,width,height,0) ||
+				daynight_init(&day,&bench.palette,cycle ? DAY_LENGTH : 0) ) {
+			return -1;
+		}
+		day.phase = 0;
+		screen_set_color_mode(&bench.screen,mode);
+		bytes = 0;
+		for( frame=0; frame<frames; frame++ ) {
+			drips_update(&bench.drips,&bench.water);
+			cloud_update(&bench.cloud,&bench.drips);
+			water_update(&bench.water);
+			daynight_update(&day);
+			bench.term.updated = 0;
+			render(&bench.water,&bench.drips,&bench.cloud,&bench.screen);
+			if( screen_encode(&bench.screen) ) {
+				return -2;
+			}
+			bytes = bytes + bench.screen.out.len;
+			bench.screen.out.len = 0;
+		}
+		printf("%s: %zux%zu %zu frames, %.1f bytes/frame, %.2f rows/frame\n",
+			cycle ? "day/night cycle" : "default sky",width,height,frames,
+			(double)bytes/frames,(double)bench.screen.rows_encoded/frames);
+		bench_world_free(&bench);
+	}
+	return 0;
+}
+
+
+//Bytes to pan one step across a world four screens wide or tall, with the
+//scene held still, against repainting the whole screen.  Columns are
+//panned through the diff and with SL/SR, rows with SU/SD.
+int bench_pan(size_t width, size_t height, uint8_t mode) {
+	bench_world_t bench;
+	termsize_t term;
+	size_t frame;
+	size_t pans;
+	size_t bytes;
+	size_t full;
+	uint8_t pass;
+	char *names[3] = {"column by diff", "column by SL/SR", "row by SU/SD"};
+	
+	for( pass=0; pass<3; pass++ ) {
+		if( bench_world_init(&bench,pass < 2 ? width*4 : width,pass < 2 ? height : height*4,0) ) {
+			return -1;
+		}
+		//The screen is a view into the world
+		term.width = width;
+		term.height = height;
+		term.updated = 1;
+		bench.screen.term = &term;
+		if( screen_update(&bench.screen) ) {
+			return -1;
+		}
+		screen_set_color_mode(&bench.screen,mode);
+		bench.screen.scroll_columns = pass == 1;
+		for( frame=0; frame<100; frame++ ) {
+			drips_update(&bench.drips,&bench.water);
+			cloud_update(&bench.cloud,&bench.drips);
+			water_update(&bench.water);
+			bench.term.updated = 0;
+		}
+		render(&bench.water,&bench.drips,&bench.cloud,&bench.screen);
+		screen_encode(&bench.screen);
+		bench.screen.out.len = 0;
+		pans = pass < 2 ? bench.term.width - width : bench.term.height - height;
+		bytes = 0;
+		full = 0;
+		for( frame=0; frame<pans; frame++ ) {
+			if( pass < 2 ) {
+				bench.screen.view_x++;
+			}
+			else {
+				bench.screen.view_y++;
+			}
+			render(&bench.water,&bench.drips,&bench.cloud,&bench.screen);
+			if( screen_encode(&bench.screen) ) {
+				return -2;
+			}
+			bytes = bytes + bench.screen.out.len;
+			bench.screen.out.len = 0;
+			bench.screen.invalid = 1;
+			screen_encode(&bench.screen);
+			full = full + bench.screen.out.len;
+			bench.screen.out.len = 0;
+		}
+		printf("pan %s: %zux%zu view over %zux%zu, %.1f bytes per step, %.1f bytes per full repaint\n",
+			names[pass],width,height,bench.term.width,bench.term.height,(double)bytes/pans,(double)full/pans);
+		bench_world_free(&bench);
+	}
+	return 0;
+}
+
+
+//Run two minutes of a stormy truecolor scene with a short day through the
+//frame loop's drawing decisions, with and without a bandwidth budget
+int bench_governor(size_t width, size_t height, size_t budget) {
+	bench_world_t bench;
+	daynight_t day;
+	storm_t storm;
+	governor_t gov;
+	size_t frame;
+	size_t frames;
+	uint8_t changed;
+	uint8_t pending = 0;
+	
+	if( bench_world_init(&bench,width,height,0) ||
+			daynight_init(&day,&bench.palette,60) || storm_init(&storm,1) ) {
+		return -1;
+	}
+	screen_set_color_mode(&bench.screen,COLORS_TRUE);
+	governor_init(&gov,budget,&bench.screen);
+	frames = 120*params_current()->frame_rate;
+	for( frame=0; frame<frames; frame++ ) {
+		changed = bench.screen.invalid | pending;
+		drips_update(&bench.drips,&bench.water);
+		cloud_update(&bench.cloud,&bench.drips);
+		water_update(&bench.water);
+		daynight_update(&day);
+		storm_update(&storm,&bench.screen);
+		changed = changed | bench.term.updated | bench.drips.updated | bench.cloud.updated | 
+			bench.water.updated | day.updated | storm.updated;
+		bench.term.updated = 0;
+		pending = changed && !governor_allow(&gov);
+		if( changed && !pending ) {
+			render(&bench.water,&bench.drips,&bench.cloud,&bench.screen);
+			if( screen_encode(&bench.screen) ) {
+				return -2;
+			}
+		}
+		governor_update(&gov,&bench.screen,bench.screen.out.len,1);
+		bench.screen.out.len = 0;
+	}
+	printf("governor: %zux%zu budget %zu B/s, %.0f B/s sent, %.1f%% of frames drawn, %.1f%% held back, "
+		"largest frame %zu bytes, level %zu\n",
+		width,height,budget,(double)gov.bytes/120,100.0*gov.frames/frames,100.0*gov.dropped/frames,
+		gov.frame_max,gov.level);
+	bench_world_free(&bench);
+	return 0;
+}
+
+
+//Time the 1D water physics with the cloud raining as usual and with a
+//calm sea, reporting the columns inside disturbed spans, spread passes
+//(summed over spans) per frame and the frames skipped idle
+int bench_water(size_t width, size_t height, size_t frames) {
+	bench_world_t bench;
+	size_t frame;
+	double start;
+	double elapsed;
+	uint8_t calm;
+	uint8_t systems = scene.systems;
+	
+	for( calm=0; calm<2; calm++ ) {
+		if( bench_world_init(&bench,width,height,0) ) {
+			return -1;
+		}
+		//Rain stopped as in a scene without it
+		if( calm ) {
+			scene.systems = systems & ~SCENE_RAIN;
+		}
+		elapsed = 0;
+		for( frame=0; frame<frames; frame++ ) {
+			//A single splash that the calm sea then absorbs
+			if( calm && frame == 1 ) {
+				bench.water.cols[width/2].speed = -10;
+				water_activate(&bench.water,width/2);
+			}
+			drips_update(&bench.drips,&bench.water);
+			cloud_update(&bench.cloud,&bench.drips);
+			start = bench_now();
+			water_update(&bench.water);
+			elapsed = elapsed + bench_now() - start;
+			bench.term.updated = 0;
+		}
+		printf("%s: %zu columns %zu frames, %.1f columns simulated/frame, %.2f spread passes/frame, "
+			"%.1f%% frames idle, %.2f us/frame\n",
+			calm ? "calm water" : "raining water",width,frames,(double)bench.water.span_columns/frames,
+			(double)bench.water.spread_passes/frames,100.0*bench.water.idle_frames/frames,elapsed*1e6/frames);
+		bench_world_free(&bench);
+	}
+	scene.systems = systems;
+	return 0;
+}
+
+
+//Time the 2D water solver against the frame budget
+int bench_wave(size_t width, size_t depth, size_t frames) {
+	termsize_t term;
+	water_t water;
+	size_t frame;
+	double start;
+	double elapsed;
+	int threads = 1;
+	
+	term.width = width;
+	term.height = 40;
+	term.updated = 1;
+	if( water_init(&water,&term,depth) ) {
+		return -1;
+	}
+	term.updated = 0;
+#ifdef _OPENMP
+	threads = omp_get_max_threads();
+#endif
+	start = bench_now();
+	for( frame=0; frame<frames; frame++ ) {
+		if( frame%5 == 0 ) {
+			water.cols[(frame*37)%width].speed = -10;
+			water_activate(&water,(frame*37)%width);
+		}
+		water_update(&water);
+	}
+	elapsed = bench_now() - start;
+	printf("2d water: %zux%zu grid, %d threads, %.3f ms/frame (%.1f%% of a %g fps frame), %.1f Mcells/s\n",
+		width,depth,threads,elapsed*1000/frames,elapsed*params_current()->frame_rate*100/frames,params_current()->frame_rate,
+		(double)width*depth*WAVE_STEPS*frames/elapsed/1e6);
+	free(water.cols);
+	return 0;
+}
+
+
+//Forget a viewer: its socket, its buffers and its slot in the list, which
+//the last viewer takes over
+void viewer_drop(viewer_t **viewers, size_t *count, viewer_t *viewer) {
+	size_t i = viewer->index;
+	
+	close(viewer->fd);
+	free(viewer->screen.shown);
+	free(viewer->screen.out.data);
+	free(viewer);
+	*count = *count - 1;
+	if( i < *count ) {
+		viewers[i] = viewers[*count];
+		viewers[i]->index = i;
+	}
+}
+
+
+//Apply one view line.  The first sets the viewer up, later ones resize it.
+int viewer_view(viewer_t *viewer, palette_t *palette, termsize_t *world, char *line) {
+	size_t width,height;
+	unsigned mode,set;
+	
+	if( sscanf(line,"view %zu %zu %u %u",&width,&height,&mode,&set) != 4 ) {
+		return -2;
+	}
+	if( !width || !height || width > 4096 || height > 4096 || mode > COLORS_TRUE || set >= GLYPH_SETS ) {
+		return -3;
+	}
+	viewer->term.updated = width != viewer->term.width || height != viewer->term.height;
+	viewer->term.width = width;
+	viewer->term.height = height;
+	if( !viewer->ready ) {
+		if( screen_init(&viewer->screen,&viewer->term,palette) ) {
+			return -4;
+		}
+		viewer->ready = 1;
+	}
+	else if( screen_update(&viewer->screen) ) {
+		return -4;
+	}
+	viewer->term.updated = 0;
+	//A client asks again after a stop, when its screen needs drawing whole
+	viewer->screen.invalid = 1;
+	screen_center(&viewer->screen,world->width,world->height);
+	if( mode != viewer->screen.color_mode ) {
+		screen_set_color_mode(&viewer->screen,mode);
+	}
+	if( set != viewer->screen.glyph_set ) {
+		screen_set_glyphs(&viewer->screen,set);
+	}
+	return 0;
+}
+
+
+//Read whatever the viewer sent and act on each complete line
+int viewer_read(viewer_t *viewer, palette_t *palette, termsize_t *world) {
+	ssize_t n;
+	char *end;
+	size_t len;
+	
+	for(;;) {
+		n = read(viewer->fd,viewer->in+viewer->in_len,VIEW_LINE-viewer->in_len);
+		if( n < 0 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			return errno == EAGAIN ? 0 : -2;
+		}
+		if( n == 0 ) {
+			return -3;
+		}
+		viewer->in_len += n;
+		while( (end = memchr(viewer->in,'\n',viewer->in_len)) ) {
+			*end = 0;
+			if( viewer_view(viewer,palette,world,viewer->in) ) {
+				return -4;
+			}
+			len = end+1 - viewer->in;
+			memmove(viewer->in,end+1,viewer->in_len-len);
+			viewer->in_len -= len;
+		}
+		if( viewer->in_len == VIEW_LINE ) {
+			return -5;
+		}
+	}
+}
+
+
+//Write as much of the viewer's frame as the socket takes.  What is left
+//waits for EPOLLOUT, and the frame loop skips the viewer until it drains.
+int viewer_flush(viewer_t *viewer, int epoll) {
+	struct epoll_event ev;
+	ssize_t n;
+	
+	while( viewer->sent < viewer->screen.out.len ) {
+		n = send(viewer->fd,viewer->screen.out.data+viewer->sent,viewer->screen.out.len-viewer->sent,MSG_NOSIGNAL);
+		if( n < 0 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			if( errno != EAGAIN ) {
+				return -2;
+			}
+			if( !viewer->waiting ) {
+				viewer->waiting = 1;
+				ev.events = EPOLLIN | EPOLLOUT;
+				ev.data.ptr = viewer;
+				epoll_ctl(epoll,EPOLL_CTL_MOD,viewer->fd,&ev);
+			}
+			return 0;
+		}
+		viewer->sent += n;
+	}
+	viewer->sent = 0;
+	viewer->screen.out.len = 0;
+	if( viewer->waiting ) {
+		viewer->waiting = 0;
+		ev.events = EPOLLIN;
+		ev.data.ptr = viewer;
+		epoll_ctl(epoll,EPOLL_CTL_MOD,viewer->fd,&ev);
+	}
+	return 0;
+}
+
+
+//Draw the world for one viewer.  A viewer still draining its last frame
+//misses this one, so a slow terminal never builds a backlog.  When it
+//catches up it gets the difference against what it last showed, or a
+//full repaint if it stalled for long.
+int viewer_frame(viewer_t *viewer, int epoll, water_t *water, drips_t *drips, cloud_t *cloud,
+		storm_t *storm, uint8_t changed) {
+	if( !viewer->ready ) {
+		return 0;
+	}
+	if( viewer->screen.out.len ) {
+		viewer->behind++;
+		return 0;
+	}
+	if( viewer->behind >= VIEWER_RESYNC ) {
+		viewer->screen.invalid = 1;
+	}
+	if( !changed && !viewer->behind && !viewer->screen.invalid ) {
+		return 0;
+	}
+	viewer->behind = 0;
+	viewer->screen.flash = storm->lit;
+	render(water,drips,cloud,&viewer->screen);
+	screen_encode(&viewer->screen);
+	return viewer_flush(viewer,epoll);
+}
+
+
+//Take every pending connection on the listening socket
+int server_accept(int listener, int epoll, viewer_t ***viewers, size_t *count, size_t *size) {
+	struct epoll_event ev;
+	viewer_t **tmp;
+	viewer_t *viewer;
+	int fd;
+	
+	for(;;) {
+		fd = accept(listener,0,0);
+		if( fd < 0 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			//Out of descriptors or memory drops only the newcomer
+			return errno == EAGAIN || errno == EMFILE || errno == ENFILE || errno == ENOMEM ? 0 : -2;
+		}
+		fcntl(fd,F_SETFL,O_NONBLOCK);
+		fcntl(fd,F_SETFD,FD_CLOEXEC);
+		if( *count == *size ) {
+			tmp = realloc(*viewers,sizeof(viewer_t*)*(*size ? *size*2 : 16));
+			if( !tmp ) {
+				close(fd);
+				continue;
+			}
+			*viewers = tmp;
+			*size = *size ? *size*2 : 16;
+		}
+		viewer = calloc(1,sizeof(viewer_t));
+		if( !viewer ) {
+			close(fd);
+			continue;
+		}
+		viewer->fd = fd;
+		viewer->index = *count;
+		ev.events = EPOLLIN;
+		ev.data.ptr = viewer;
+		if( epoll_ctl(epoll,EPOLL_CTL_ADD,fd,&ev) ) {
+			close(fd);
+			free(viewer);
+			continue;
+		}
+		(*viewers)[*count] = viewer;
+		*count = *count + 1;
+	}
+}
+
+
+//Run one simulation at the size in term and draw it for every viewer that
+//connects to the Unix socket at path, each at its own size, color mode
+//and glyph set.  Parameters are reloaded from config on SIGHUP.  Only
+//returns on error.
+int server_run(const char *path, const char *config, termsize_t *term, drips_t *drips, cloud_t *cloud,
+		water_t *water, daynight_t *day, storm_t *storm, palette_t *palette) {
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	struct epoll_event events[SERVER_EVENTS];
+	struct stat st;
+	viewer_t **viewers = 0;
+	viewer_t *viewer;
+	size_t count = 0;
+	size_t size = 0;
+	size_t i;
+	double next;
+	double now;
+	int listener;
+	int epoll;
+	int timeout;
+	int n;
+	int e;
+	uint8_t changed;
+	
+	if( strlen(path) >= sizeof(addr.sun_path) ) {
+		return -1;
+	}
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path,path);
+	//A socket left behind by an earlier server is replaced, anything else is not
+	if( !lstat(path,&st) && S_ISSOCK(st.st_mode) ) {
+		unlink(path);
+	}
+	listener = socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+	if( listener < 0 ) {
+		return -2;
+	}
+	if( bind(listener,(struct sockaddr*)&addr,sizeof(addr)) || listen(listener,SOMAXCONN) ) {
+		close(listener);
+		return -3;
+	}
+	epoll = epoll_create1(EPOLL_CLOEXEC);
+	if( epoll < 0 ) {
+		close(listener);
+		return -4;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = 0;
+	epoll_ctl(epoll,EPOLL_CTL_ADD,listener,&ev);
+	
+	next = bench_now();
+	for(;;) {
+		if( params_reload ) {
+			params_reload = 0;
+			if( config ) {
+				params_swap(config);
+			}
+		}
+		now = bench_now();
+		timeout = next > now ? (int)((next-now)*1000) + 1 : 0;
+		n = epoll_wait(epoll,events,SERVER_EVENTS,timeout);
+		if( n < 0 && errno != EINTR ) {
+			break;
+		}
+		for( e=0; e<n; e++ ) {
+			viewer = events[e].data.ptr;
+			if( !viewer ) {
+				if( server_accept(listener,epoll,&viewers,&count,&size) ) {
+					break;
+				}
+				continue;
+			}
+			if( (events[e].events & (EPOLLIN|EPOLLHUP|EPOLLERR) && viewer_read(viewer,palette,term)) ||
+					(events[e].events & EPOLLOUT && viewer_flush(viewer,epoll)) ) {
+				viewer_drop(viewers,&count,viewer);
+			}
+		}
+		if( e < n ) {
+			break;
+		}
+		
+		now = bench_now();
+		if( now < next ) {
+			continue;
+		}
+		//A late frame is not made up for with a burst
+		next = next + params_current()->frame_delay/1e6;
+		next = next < now ? now : next;
+		drips_update(drips,water);
+		cloud_update(cloud,drips);
+		water_update(water);
+		daynight_update(day);
+		storm_update(storm,0);
+		changed = term->updated | drips->updated | cloud->updated | 
+			water->updated | day->updated | storm->updated;
+		term->updated = 0;
+		for( i=0; i<count; ) {
+			if( viewer_frame(viewers[i],epoll,water,drips,cloud,storm,changed) ) {
+				viewer_drop(viewers,&count,viewers[i]);
+				continue;
+			}
+			i++;
+		}
+	}
+	for( i=count; i>0; i-- ) {
+		viewer_drop(viewers,&count,viewers[i-1]);
+	}
+	free(viewers);
+	close(epoll);
+	close(listener);
+	unlink(path);
+	return -5;
+}
+
+
+//Show the frames a server (-L) draws for this terminal, asking again
+//whenever the terminal is resized.  Returns 0 when the server goes away
+//or on q.
+int client_run(const char *path, uint8_t mode, uint8_t set) {
+	struct sockaddr_un addr;
+	struct pollfd pfd;
+	termsize_t term;
+	input_t input;
+	outbuf_t out;
+	char buf[1<<16];
+	char line[VIEW_LINE];
+	ssize_t n;
+	int fd;
+	int err = 0;
+	
+	if( strlen(path) >= sizeof(addr.sun_path) ) {
+		return -1;
+	}
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path,path);
+	fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+	if( fd < 0 ) {
+		return -2;
+	}
+	if( connect(fd,(struct sockaddr*)&addr,sizeof(addr)) ) {
+		close(fd);
+		return -3;
+	}
+	if( termsize_init(&term) ) {
+		close(fd);
+		return -4;
+	}
+	if( input_init(&input) ) {
+		close(fd);
+		return -7;
+	}
+	term.updated = 1;
+	out.data = buf;
+	out.size = sizeof(buf);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for(;;) {
+		input_update(&input,0,0,0,0,0);
+		if( input.quit ) {
+			break;
+		}
+		//Asking again repaints what was lost while stopped
+		if( input_resumed ) {
+			input_resumed = 0;
+			term.updated = 1;
+		}
+		if( term.updated ) {
+			n = snprintf(line,sizeof(line),"view %zu %zu %u %u\n",term.width,term.height,mode,set);
+			if( send(fd,line,n,MSG_NOSIGNAL) != n ) {
+				break;
+			}
+		}
+		//Wake up now and then to notice a resize
+		n = poll(&pfd,1,100);
+		if( n < 0 && errno != EINTR ) {
+			err = -5;
+			break;
+		}
+		if( n > 0 ) {
+			n = read(fd,buf,sizeof(buf));
+			if( n <= 0 ) {
+				break;
+			}
+			out.len = n;
+			if( outbuf_flush(&out,STDOUT_FILENO) ) {
+				err = -6;
+				break;
+			}
+		}
+		termsize_update(&term);
+	}
+	close(fd);
+	//The last frame may have stopped inside a colored run
+	out.len = 0;
+	out_str(&out,input.alternate ? "\x1b[0m" : "\x1b[0m\n");
+	outbuf_flush(&out,STDOUT_FILENO);
+	input_restore(&input);
+	return err;
+}
+
+
+void shm_signal(int sig) {
+	(void)sig;
+	shm_quit = 1;
+}
+
+
+//Create the named segment for a world of width by height cells.  A
+//segment left behind by an earlier publisher is replaced; its viewers
+//notice when its pid is gone.
+int shm_ring_create(shm_ring_t *ring, const char *name, size_t width, size_t height) {
+	shm_header_t *head;
+	size_t stride;
+	size_t size;
+	void *map;
+	int fd;
+	
+	if( !ring || !name ) {
+		return -1;
+	}
+	//Slots start on their own cache lines
+	stride = (sizeof(shm_slot_t) + sizeof(cell_t)*width*height + 63) & ~(size_t)63;
+	size = SHM_HEADER + stride*SHM_SLOTS;
+	shm_unlink(name);
+	fd = shm_open(name,O_RDWR|O_CREAT|O_EXCL,0644);
+	if( fd < 0 ) {
+		return -2;
+	}
+	if( ftruncate(fd,size) ) {
+		close(fd);
+		shm_unlink(name);
+		return -3;
+	}
+	map = mmap(0,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if( map == MAP_FAILED ) {
+		shm_unlink(name);
+		return -4;
+	}
+	head = map;
+	head->slots = SHM_SLOTS;
+	head->width = width;
+	head->height = height;
+	head->stride = stride;
+	head->pid = getpid();
+	head->frame = 0;
+	__atomic_store_n(&head->magic,SHM_MAGIC,__ATOMIC_RELEASE);
+	ring->head = head;
+	ring->size = size;
+	return 0;
+}
+
+
+shm_slot_t *shm_ring_slot(shm_ring_t *ring, uint64_t frame) {
+	return (shm_slot_t*)((char*)ring->head + SHM_HEADER + ring->head->stride*(frame%ring->head->slots));
+}
+
+
+//Write the composed cells of a world sized screen into the next slot.
+//Readers hold no locks, so this never waits for them.
+int shm_ring_publish(shm_ring_t *ring, screen_t *screen, uint8_t flash) {
+	shm_slot_t *slot;
+	uint64_t frame;
+	uint64_t seq;
+	
+	if( !ring || !screen ) {
+		return -1;
+	}
+	if( screen->width != ring->head->width || screen->height != ring->head->height ) {
+		return -2;
+	}
+	frame = ring->head->frame + 1;
+	slot = shm_ring_slot(ring,frame);
+	seq = slot->seq;
+	__atomic_store_n(&slot->seq,seq+1,__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->frame = frame;
+	slot->flash = flash;
+	slot->palette = *screen->palette;
+	memcpy(slot->cells,screen->cells,sizeof(cell_t)*screen->width*screen->height);
+	__atomic_store_n(&slot->seq,seq+2,__ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head->frame,frame,__ATOMIC_RELEASE);
+	return 0;
+}
+
+
+//Map a published segment read-only
+int shm_ring_open(shm_ring_t *ring, const char *name) {
+	shm_header_t *head;
+	struct stat st;
+	void *map;
+	int fd;
+	
+	if( !ring || !name ) {
+		return -1;
+	}
+	fd = shm_open(name,O_RDONLY,0);
+	if( fd < 0 ) {
+		return -2;
+	}
+	if( fstat(fd,&st) || (size_t)st.st_size < SHM_HEADER ) {
+		close(fd);
+		return -3;
+	}
+	map = mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if( map == MAP_FAILED ) {
+		return -4;
+	}
+	head = map;
+	if( __atomic_load_n(&head->magic,__ATOMIC_ACQUIRE) != SHM_MAGIC || !head->slots ||
+			head->stride < sizeof(shm_slot_t) + sizeof(cell_t)*head->width*head->height ||
+			SHM_HEADER + head->stride*head->slots > (size_t)st.st_size ) {
+		munmap(map,st.st_size);
+		return -5;
+	}
+	ring->head = head;
+	ring->size = st.st_size;
+	return 0;
+}
+
+
+//Copy the newest frame into the screen's cells, centered and standing on
+//the bottom row, along with its palette and flash.
+//Returns 1 while the frame is still the one in *frame, or while the slot
+//stays half written, as it does when the publisher died writing it.
+int shm_ring_read(shm_ring_t *ring, screen_t *screen, uint64_t *frame) {
+	shm_slot_t *slot;
+	size_t tries;
+	uint64_t newest;
+	uint64_t seq;
+	size_t ww,wh;
+	size_t y,x;
+	size_t lo,hi;
+	ptrdiff_t ox,oy;
+	ptrdiff_t wy;
+	cell_t *row;
+	cell_t *src;
+	
+	if( !ring || !screen || !frame ) {
+		return -1;
+	}
+	ww = ring->head->width;
+	wh = ring->head->height;
+	screen_center(screen,ww,wh);
+	ox = screen->view_x;
+	oy = screen->view_y;
+	//Columns of the screen that fall inside the world
+	lo = ox < 0 ? -ox : 0;
+	hi = (ptrdiff_t)ww - ox < (ptrdiff_t)screen->width ? (size_t)((ptrdiff_t)ww - ox) : screen->width;
+	for( tries=0; tries<SHM_RETRIES; tries++ ) {
+		newest = __atomic_load_n(&ring->head->frame,__ATOMIC_ACQUIRE);
+		if( newest == *frame ) {
+			return 1;
+		}
+		slot = shm_ring_slot(ring,newest);
+		seq = __atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE);
+		if( seq & 1 ) {
+			continue;
+		}
+		*screen->palette = slot->palette;
+		screen->flash = slot->flash;
+		for( y=0; y<screen->height; y++ ) {
+			row = &screen->cells[y*screen->width];
+			wy = (ptrdiff_t)y + oy;
+			//Above the world the top row's sky goes on, past its sides the edge
+			src = &slot->cells[(wy < 0 ? 0 : wy)*ww];
+			for( x=0; x<lo; x++ ) {
+				row[x] = src[0];
+			}
+			memcpy(row+lo,src+lo+ox,sizeof(cell_t)*(hi-lo));
+			for( x=hi; x<screen->width; x++ ) {
+				row[x] = src[ww-1];
+			}
+			if( wy < 0 ) {
+				for( x=0; x<screen->width; x++ ) {
+					row[x].glyph = GLYPH_SPACE;
+				}
+			}
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		//The publisher lapped the ring while this was copied
+		if( __atomic_load_n(&slot->seq,__ATOMIC_RELAXED) != seq || slot->frame != newest ) {
+			continue;
+		}
+		*frame = newest;
+		return 0;
+	}
+	return 1;
+}
+
+
+//Publish the world (-M) for viewers on this host until a signal ends it
+int shm_publish_run(const char *name, const char *config, termsize_t *term, drips_t *drips, cloud_t *cloud,
+		water_t *water, daynight_t *day, storm_t *storm, screen_t *screen) {
+	shm_ring_t ring;
+	uint8_t changed;
+	
+	if( shm_ring_create(&ring,name,term->width,term->height) ) {
+		return -2;
+	}
+	signal(SIGINT,shm_signal);
+	signal(SIGTERM,shm_signal);
+	while( !shm_quit ) {
+		if( params_reload ) {
+			params_reload = 0;
+			if( config ) {
+				params_swap(config);
+			}
+		}
+		drips_update(drips,water);
+		cloud_update(cloud,drips);
+		water_update(water);
+		daynight_update(day);
+		storm_update(storm,0);
+		changed = term->updated | drips->updated | cloud->updated | 
+			water->updated | day->updated | storm->updated;
+		term->updated = 0;
+		if( changed ) {
+			render(water,drips,cloud,screen);
+			shm_ring_publish(&ring,screen,storm->lit);
+		}
+		usleep(params_current()->frame_delay);
+	}
+	munmap(ring.head,ring.size);
+	shm_unlink(name);
 	return 0;
 }
 
 
-int drips_update(drips_t* drips, water_t *water) {
-	size_t i;
+//Show frames published on this host (-V), encoded for this terminal.
+//Returns 0 once the publisher is gone.
+int shm_view_run(const char *name, uint8_t mode, uint8_t set) {
+	shm_ring_t ring;
+	termsize_t term;
+	input_t input;
+	palette_t palette;
+	screen_t screen;
+	uint64_t frame = 0;
+	int err = 0;
+	int r;
 	
-	if( ! drips ) {
+	if( shm_ring_open(&ring,name) ) {
+		return -2;
+	}
+	if( termsize_init(&term) || palette_init(&palette) || screen_init(&screen,&term,&palette) ) {
+		munmap(ring.head,ring.size);
+		return -3;
+	}
+	if( input_init(&input) ) {
+		munmap(ring.head,ring.size);
+		free(screen.shown);
+		free(screen.out.data);
+		return -6;
+	}
+	screen_set_color_mode(&screen,mode);
+	screen_set_glyphs(&screen,set);
+	for(;;) {
+		input_update(&input,0,0,0,0,0);
+		if( input.quit ) {
+			break;
+		}
+		if( input_resumed ) {
+			input_resumed = 0;
+			screen.invalid = 1;
+		}
+		termsize_update(&term);
+		if( screen_update(&screen) ) {
+			err = -4;
+			break;
+		}
+		//Resized cells are filled from the same frame again
+		if( term.updated ) {
+			frame = 0;
+		}
+		r = shm_ring_read(&ring,&screen,&frame);
+		if( r == 1 && kill(ring.head->pid,0) && errno == ESRCH ) {
+			break;
+		}
+		if( r == 0 || (screen.invalid && frame) ) {
+			screen_encode(&screen);
+			if( outbuf_flush(&screen.out,STDOUT_FILENO) ) {
+				err = -5;
+				break;
+			}
+		}
+		usleep(params_current()->frame_delay);
+	}
+	munmap(ring.head,ring.size);
+	free(screen.shown);
+	free(screen.out.data);
+	outbuf_init(&screen.out);
+	outbuf_reserve(&screen.out,16);
+	out_str(&screen.out,input.alternate ? "\x1b[0m" : "\x1b[0m\n");
+	outbuf_flush(&screen.out,STDOUT_FILENO);
+	free(screen.out.data);
+	input_restore(&input);
+	return err;
+}
+
+
+int raster_init(raster_t *raster, uint8_t format) {
+	if( !raster ) {
 		return -1;
 	}
-	if( ! water ) {
+	raster->format = format;
+	raster->width = 0;
+	raster->height = 0;
+	raster->frame = 0;
+	raster->frame_size = 0;
+	raster->shown = 0;
+	raster->hits = 0;
+	raster->misses = 0;
+	raster->tiles = calloc(RASTER_TILES,sizeof(raster_tile_t));
+	if( !raster->tiles ) {
 		return -2;
 	}
+	return 0;
+}
+
+
+//Size the frame for a screen of width by height cells, all to be drawn
+int raster_resize(raster_t *raster, size_t width, size_t height) {
+	size_t pixels = width*RASTER_CW*height*RASTER_CH;
+	size_t i;
 	
-	for( i=0; i<drips->size; i++ ) {
-		if( drips->drips[i].active ) {
-			drips->drips[i].speed = drips->drips[i].speed - GRAVITY;
-			if( drips->drips[i].y < drips->drips[i].speed ) {
-				drips->drips[i].y = 0;
-			}
-			else {
-				drips->drips[i].y = drips->drips[i].y + drips->drips[i].speed;
-			}
-			if( drips->drips[i].y <= water->cols[drips->drips->x].height ) {
-				water->cols[drips->drips->x].speed = water->cols[drips->drips->x].speed + 
-					drips->drips[i].speed;
-				drips->drips[i].active = 0;
-				if( water->target_height < (water->term->height-3)*8 ) {
-					water->target_height = water->target_height + 8.0 / water->term->width;
-				}
+	free(raster->frame);
+	free(raster->shown);
+	raster->width = width;
+	raster->height = height;
+	//4:2:0 keeps one U and one V for every 2x2 pixels
+	raster->frame_size = raster->format == RASTER_Y4M ? pixels*3/2 : pixels*3;
+	raster->frame = malloc(raster->frame_size);
+	raster->shown = malloc(sizeof(shown_t)*width*height);
+	if( !raster->frame || !raster->shown ) {
+		raster->width = 0;
+		raster->height = 0;
+		return -1;
+	}
+	for( i=0; i<width*height; i++ ) {
+		raster->shown[i].glyph = GLYPH_COUNT;
+		raster->shown[i].fg = COLOR_ANY;
+		raster->shown[i].bg = COLOR_ANY;
+	}
+	return 0;
+}
+
+
+//Full range BT.601, as Y4M C420jpeg expects
+void raster_yuv(uint32_t rgb, int32_t *y, int32_t *u, int32_t *v) {
+	int32_t r = (rgb>>16)&0xff;
+	int32_t g = (rgb>>8)&0xff;
+	int32_t b = rgb&0xff;
+	
+	*y = (19595*r + 38470*g + 7471*b + 32768) >> 16;
+	*u = 128 + ((-11059*r - 21709*g + 32768*b + 32768) >> 16);
+	*v = 128 + ((32768*r - 27439*g - 5329*b + 32768) >> 16);
+}
+
+
+//Draw glyph in fg on bg into a tile: RGB rows, or the Y rows followed by
+//the U and V rows of its 2x2 blocks
+void raster_tile_draw(raster_tile_t *tile, uint8_t format) {
+	const uint8_t *rows = raster_font[tile->glyph];
+	uint32_t fg = tile->fg == COLOR_DEFAULT ? RASTER_FG : tile->fg;
+	uint32_t bg = tile->bg == COLOR_DEFAULT ? RASTER_BG : tile->bg;
+	uint8_t *p = tile->pixels;
+	uint8_t *cu,*cv;
+	int32_t yf,uf,vf,yb,ub,vb;
+	uint32_t c;
+	size_t x,y,n;
+	
+	if( format == RASTER_RGB ) {
+		for( y=0; y<RASTER_CH; y++ ) {
+			for( x=0; x<RASTER_CW; x++ ) {
+				c = rows[y] & (0x80>>x) ? fg : bg;
+				*p++ = c>>16;
+				*p++ = c>>8;
+				*p++ = c;
 			}
 		}
+		return;
+	}
+	raster_yuv(fg,&yf,&uf,&vf);
+	raster_yuv(bg,&yb,&ub,&vb);
+	for( y=0; y<RASTER_CH; y++ ) {
+		for( x=0; x<RASTER_CW; x++ ) {
+			*p++ = rows[y] & (0x80>>x) ? yf : yb;
+		}
+	}
+	cu = p;
+	cv = p + RASTER_CW*RASTER_CH/4;
+	for( y=0; y<RASTER_CH; y+=2 ) {
+		for( x=0; x<RASTER_CW; x+=2 ) {
+			n = __builtin_popcount(((rows[y]<<x)&0xc0) | (((rows[y+1]<<x)&0xc0)>>2));
+			*cu++ = (n*uf + (4-n)*ub + 2)/4;
+			*cv++ = (n*vf + (4-n)*vb + 2)/4;
+		}
 	}
-	return 0;
 }
 
 
-int cloud_init(cloud_t *cloud, termsize_t *term) {
-	if( !cloud ) {
+//The tile for a glyph in resolved colors, drawn on a miss.  The cache is
+//direct mapped, so a colliding tile is simply drawn over.
+raster_tile_t *raster_tile(raster_t *raster, uint32_t glyph, uint32_t fg, uint32_t bg) {
+	uint32_t h = (glyph*0x9e3779b1) ^ (fg*0x85ebca77) ^ (bg*0xc2b2ae3d);
+	raster_tile_t *tile;
+	
+	h = h ^ (h>>15);
+	tile = &raster->tiles[(h*0x2c1b3c6d)>>(32-RASTER_TILE_BITS)];
+	if( tile->used && tile->glyph == glyph && tile->fg == fg && tile->bg == bg ) {
+		raster->hits++;
+		return tile;
+	}
+	raster->misses++;
+	tile->used = 1;
+	tile->glyph = glyph;
+	tile->fg = fg;
+	tile->bg = bg;
+	raster_tile_draw(tile,raster->format);
+	return tile;
+}
+
+
+//Copy a tile into the frame at cell x,y
+void raster_blit(raster_t *raster, raster_tile_t *tile, size_t x, size_t y) {
+	size_t pw = raster->width*RASTER_CW;
+	size_t ph = raster->height*RASTER_CH;
+	const uint8_t *src = tile->pixels;
+	uint8_t *dst;
+	size_t r;
+	
+	if( raster->format == RASTER_RGB ) {
+		dst = raster->frame + (y*RASTER_CH*pw + x*RASTER_CW)*3;
+		for( r=0; r<RASTER_CH; r++ ) {
+			memcpy(dst,src,RASTER_CW*3);
+			dst = dst + pw*3;
+			src = src + RASTER_CW*3;
+		}
+		return;
+	}
+	dst = raster->frame + y*RASTER_CH*pw + x*RASTER_CW;
+	for( r=0; r<RASTER_CH; r++ ) {
+		memcpy(dst,src,RASTER_CW);
+		dst = dst + pw;
+		src = src + RASTER_CW;
+	}
+	//U then V plane, a quarter of the pixels each
+	dst = raster->frame + pw*ph + y*RASTER_CH/2*pw/2 + x*RASTER_CW/2;
+	for( r=0; r<RASTER_CH/2; r++ ) {
+		memcpy(dst,src,RASTER_CW/2);
+		dst = dst + pw/2;
+		src = src + RASTER_CW/2;
+	}
+	dst = raster->frame + pw*ph + pw*ph/4 + y*RASTER_CH/2*pw/2 + x*RASTER_CW/2;
+	for( r=0; r<RASTER_CH/2; r++ ) {
+		memcpy(dst,src,RASTER_CW/2);
+		dst = dst + pw/2;
+		src = src + RASTER_CW/2;
+	}
+}
+
+
+//Bring the frame up to the screen's cells.  Only cells whose glyph or
+//resolved colors changed since the last frame are drawn again.
+int raster_update(raster_t *raster, screen_t *screen) {
+	uint32_t *colors;
+	cell_t *cell;
+	shown_t *shown;
+	uint32_t fg,bg;
+	size_t x,y;
+	
+	if( !raster || !screen ) {
 		return -1;
 	}
-	if( !term ) {
+	if( (raster->width != screen->width || raster->height != screen->height) &&
+			raster_resize(raster,screen->width,screen->height) ) {
 		return -2;
 	}
+	screen_palette_sync(screen);
+	colors = screen->flash ? screen->flash_colors : screen->colors;
+	cell = screen->cells;
+	shown = raster->shown;
+	for( y=0; y<raster->height; y++ ) {
+		for( x=0; x<raster->width; x++,cell++,shown++ ) {
+			fg = colors[cell->fg];
+			bg = colors[cell->bg];
+			if( shown->glyph == cell->glyph && shown->fg == fg && shown->bg == bg ) {
+				continue;
+			}
+			shown->glyph = cell->glyph;
+			shown->fg = fg;
+			shown->bg = bg;
+			raster_blit(raster,raster_tile(raster,cell->glyph,fg,bg),x,y);
+		}
+	}
+	return 0;
+}
+
+
+//Render the world headless (-R) as fast as frames can be drawn and
+//written, for frames or until the output is closed
+int raster_run(uint8_t format, size_t frames, const char *config, termsize_t *term, drips_t *drips,
+		cloud_t *cloud, water_t *water, daynight_t *day, storm_t *storm, screen_t *screen) {
+	raster_t raster;
+	outbuf_t out;
+	char header[128];
+	double rate;
+	size_t frame;
+	int err = 0;
 	
-	cloud->term = term;
-	cloud->pos = (term->width*8)/2-2;
-	cloud->speed = CLOUD_SPEED;
+	if( raster_init(&raster,format) ) {
+		return -2;
+	}
+	//Every color is kept as it is, nothing is quantized for a terminal
+	screen_set_color_mode(screen,COLORS_TRUE);
+	signal(SIGPIPE,SIG_IGN);
+	out.size = sizeof(header);
+	if( format == RASTER_Y4M ) {
+		rate = params_current()->frame_rate;
+		out.data = header;
+		out.len = snprintf(header,sizeof(header),"YUV4MPEG2 W%zu H%zu F%.0f:1000 Ip A1:1 C420jpeg\n",
+			term->width*RASTER_CW,term->height*RASTER_CH,rate*1000);
+		if( outbuf_flush(&out,STDOUT_FILENO) ) {
+			err = -3;
+		}
+	}
+	for( frame=0; !err && (!frames || frame<frames); frame++ ) {
+		if( params_reload ) {
+			params_reload = 0;
+			if( config ) {
+				params_swap(config);
+			}
+		}
+		drips_update(drips,water);
+		cloud_update(cloud,drips);
+		water_update(water);
+		daynight_update(day);
+		storm_update(storm,screen);
+		if( term->updated | drips->updated | cloud->updated | water->updated ) {
+			render(water,drips,cloud,screen);
+		}
+		term->updated = 0;
+		if( raster_update(&raster,screen) ) {
+			err = -4;
+			break;
+		}
+		if( format == RASTER_Y4M ) {
+			out.data = "FRAME\n";
+			out.len = 6;
+			out.size = 6;
+			if( outbuf_flush(&out,STDOUT_FILENO) ) {
+				break;
+			}
+		}
+		out.data = (char*)raster.frame;
+		out.len = raster.frame_size;
+		out.size = raster.frame_size;
+		//A closed pipe is the end of the video, not an error
+		if( outbuf_flush(&out,STDOUT_FILENO) ) {
+			break;
+		}
+	}
+	free(raster.frame);
+	free(raster.shown);
+	free(raster.tiles);
+	return err;
+}
+
+
+//Cost of publishing a world and of a viewer copying it out, against the
+//frame budget
+int bench_shm(size_t width, size_t height, size_t frames) {
+	bench_world_t bench;
+	termsize_t view_term;
+	palette_t view_palette;
+	screen_t view;
+	shm_ring_t ring;
+	shm_ring_t reader;
+	char name[64];
+	uint64_t seen = 0;
+	size_t frame;
+	double publish = 0;
+	double read = 0;
+	double start;
 	
-	cloud->drop_count = 0;
-	cloud->drop_delay = 30;
-	return 0;
+	snprintf(name,sizeof(name),"/island-bench-%d",(int)getpid());
+	if( bench_world_init(&bench,width,height,0) ) {
+		return -1;
+	}
+	view_term = bench.term;
+	if( palette_init(&view_palette) || screen_init(&view,&view_term,&view_palette) ) {
+		return -1;
+	}
+	if( shm_ring_create(&ring,name,width,height) ) {
+		return -2;
+	}
+	if( shm_ring_open(&reader,name) ) {
+		shm_unlink(name);
+		return -3;
+	}
+	for( frame=0; frame<frames; frame++ ) {
+		drips_update(&bench.drips,&bench.water);
+		cloud_update(&bench.cloud,&bench.drips);
+		water_update(&bench.water);
+		bench.term.updated = 0;
+		render(&bench.water,&bench.drips,&bench.cloud,&bench.screen);
+		start = bench_now();
+		shm_ring_publish(&ring,&bench.screen,0);
+		publish += bench_now() - start;
+		start = bench_now();
+		shm_ring_read(&reader,&view,&seen);
+		read += bench_now() - start;
+		if( memcmp(view.cells,bench.screen.cells,sizeof(cell_t)*width*height) ) {
+			printf("shm: frame %zu read back different\n",frame);
+			break;
+		}
+	}
+	printf("shm: %zux%zu %zu bytes per frame, publish %.2f us, read %.2f us (%.3f%% of a %g fps frame)\n",
+		width,height,sizeof(cell_t)*width*height,publish*1e6/frames,read*1e6/frames,
+		(publish+read)*params_current()->frame_rate*100/frames,params_current()->frame_rate);
+	munmap(ring.head,ring.size);
+	munmap(reader.head,reader.size);
+	shm_unlink(name);
+	free(view.shown);
+	free(view.out.data);
+	bench_world_free(&bench);
+	return frame < frames ? -4 : 0;
 }
 
 
-int cloud_update(cloud_t *cloud, drips_t *drips) {
-	if( !cloud ) {
+//Loading a scene file and composing its backdrop, against the 1 ms a
+//scene has to be ready in
+int bench_scene(const char *path, size_t width, size_t height, size_t loads) {
+	termsize_t term;
+	water_t water;
+	scene_t *bench;
+	size_t i;
+	double load = 0;
+	double compose = 0;
+	double start;
+	
+	bench = malloc(sizeof(scene_t));
+	if( !bench || scene_init(bench) ) {
+		free(bench);
 		return -1;
 	}
-		
-	if( cloud->term->updated ) {
-		if( cloud->term->width < 5 ) {
-			cloud->pos = 0;
+	if( access(path,R_OK) ) {
+		printf("scene: %s not found, skipped\n",path);
+		free(bench);
+		return 0;
+	}
+	term.width = width;
+	term.height = height;
+	term.updated = 1;
+	if( water_init(&water,&term,0) ) {
+		free(bench);
+		return -2;
+	}
+	for( i=0; i<loads; i++ ) {
+		start = bench_now();
+		if( scene_load(bench,path) ) {
+			printf("scene: %s line %zu does not load\n",path,bench->line);
+			break;
+		}
+		load += bench_now() - start;
+		start = bench_now();
+		scene_backdrop(bench,&water);
+		compose += bench_now() - start;
+	}
+	if( i == loads ) {
+		printf("scene: %s %zu sprites %zu layers, load %.1f us, %zux%zu backdrop %.1f us\n",path,
+			bench->sprite_count,bench->layer_count,load*1e6/loads,width,height,compose*1e6/loads);
+	}
+	free(bench->backdrop);
+	free(bench);
+	free(water.cols);
+	return i < loads ? -3 : 0;
+}
+
+
+//Drawing many sprites a frame, by spans and a cell at a time, on a
+//screen's worth of cells.  Both must leave the same cells.
+int bench_sprites(size_t width, size_t height, size_t count, size_t frames) {
+	char text[] = "key @ cloud cloud sky\nkey F drip sand water\nkey B cloud black sky\n"
+		"sprite cloud 9 3\n  @@@@@  \n@@@@@@@@@\n @@@@@@@ \nsprite fish 4 1\nFFFF\nsprite bird 3 2\nB.B\n.B.\n";
+	scene_t *bench;
+	cell_t *spans;
+	cell_t *cells;
+	ptrdiff_t *at;
+	sprite_t *sprite;
+	size_t frame,i;
+	double by_span = 0;
+	double by_cell = 0;
+	double start;
+	int err = 0;
+	
+	srandom(1);
+	bench = malloc(sizeof(scene_t));
+	spans = calloc(width*height,sizeof(cell_t));
+	cells = calloc(width*height,sizeof(cell_t));
+	at = malloc(sizeof(ptrdiff_t)*2*count);
+	if( !bench || !spans || !cells || !at || scene_init(bench) || scene_parse(bench,text) ) {
+		err = -1;
+	}
+	for( frame=0; !err && frame<frames; frame++ ) {
+		//Some hang off the edges
+		for( i=0; i<count; i++ ) {
+			at[2*i] = random()%(width+8) - 4;
+			at[2*i+1] = random()%(height+4) - 2;
+		}
+		start = bench_now();
+		for( i=0; i<count; i++ ) {
+			sprite_blit(bench,&bench->sprites[i%bench->sprite_count],spans,width,height,at[2*i],at[2*i+1]);
+		}
+		by_span += bench_now() - start;
+		start = bench_now();
+		for( i=0; i<count; i++ ) {
+			sprite = &bench->sprites[i%bench->sprite_count];
+			sprite_blit_cells(bench,sprite,cells,width,height,at[2*i],at[2*i+1]);
 		}
-		else if( cloud->pos >= (cloud->term->width-5)*8 ) {
-			cloud->pos = (cloud->term->width-5)*8;
+		by_cell += bench_now() - start;
+		if( memcmp(spans,cells,sizeof(cell_t)*width*height) ) {
+			printf("sprites: frame %zu spans and cells differ\n",frame);
+			err = -2;
 		}
 	}
+	if( !err ) {
+		printf("sprites: %zu a frame on %zux%zu, %zu spans, by span %.1f ns, by cell %.1f ns a sprite\n",
+			count,width,height,bench->span_count,by_span*1e9/frames/count,by_cell*1e9/frames/count);
+	}
+	free(bench);
+	free(spans);
+	free(cells);
+	free(at);
+	return err;
+}
+
+
+//Headless frames against realtime: a frame as the rain changes it, and
+//one drawn in full, in both output formats
+int bench_raster(size_t width, size_t height, size_t frames) {
+	bench_world_t bench;
+	raster_t raster;
+	uint8_t format;
+	size_t frame;
+	size_t i;
+	double busy,full;
+	double start;
 	
-	if( random()%(cloud->term->width*8) == 0 ) {
-		cloud->speed = -1*cloud->speed;
+	for( format=RASTER_RGB; format<=RASTER_Y4M; format++ ) {
+		if( bench_world_init(&bench,width,height,0) || raster_init(&raster,format) ) {
+			return -1;
+		}
+		screen_set_color_mode(&bench.screen,COLORS_TRUE);
+		busy = 0;
+		full = 0;
+		for( frame=0; frame<frames; frame++ ) {
+			drips_update(&bench.drips,&bench.water);
+			cloud_update(&bench.cloud,&bench.drips);
+			water_update(&bench.water);
+			bench.term.updated = 0;
+			render(&bench.water,&bench.drips,&bench.cloud,&bench.screen);
+			start = bench_now();
+			if( raster_update(&raster,&bench.screen) ) {
+				return -2;
+			}
+			busy += bench_now() - start;
+		}
+		for( frame=0; frame<frames/10; frame++ ) {
+			for( i=0; i<width*height; i++ ) {
+				raster.shown[i].glyph = GLYPH_COUNT;
+			}
+			start = bench_now();
+			raster_update(&raster,&bench.screen);
+			full += bench_now() - start;
+		}
+		printf("raster %s: %zux%zu pixels %zu bytes per frame, rain %.0f frames/s (%.0fx realtime), "
+			"full %.0f frames/s, tile cache %.4f%% hits\n",
+			format == RASTER_Y4M ? "y4m" : "rgb",width*RASTER_CW,height*RASTER_CH,raster.frame_size,
+			frames/busy,frames/busy/params_current()->frame_rate,(frames/10)/full,
+			100.0*raster.hits/(raster.hits+raster.misses));
+		free(raster.frame);
+		free(raster.shown);
+		free(raster.tiles);
+		bench_world_free(&bench);
 	}
+	return 0;
+}
+
+
+void usage(char *name) {
+	size_t i;
 	
-	cloud->pos = cloud->pos + cloud->speed;
-	if( cloud->pos >= (cloud->term->width-5)*8 ) {
-		cloud->pos = (cloud->term->width-5)*8;
-		cloud->speed = -CLOUD_SPEED;
+	printf("Usage: %s [-f FILE] [-e SCENE] [-l] [-o] [-d SECONDS] [-w DEPTH] [-x] [-X FRAMES] [-z FRAMES] [-c 16|256|true] [-a] [-r] [-u] [-p] [-B BYTES] [-s] [-S FILE] [-b] [-g WIDTHxHEIGHT] [-L|-C SOCKET] [-M|-V NAME] [-R rgb|y4m] [-N FRAMES]\n",name);
+	printf("  -f  Read key=value parameters from FILE, and again on SIGHUP:\n     ");
+	for( i=0; i<PARAM_KEYS; i++ ) {
+		printf(" %s",param_keys[i].name);
 	}
-	if( cloud->pos <= 0 ) {
-		cloud->pos = 0;
-		cloud->speed = CLOUD_SPEED;
+	printf("\n");
+	printf("  -e  Draw the scene described in SCENE (see scenes/)\n");
+	printf("  -l  Storm with lightning flashes\n");
+	printf("  -o  Flash by redefining the terminal palette (OSC 4)\n");
+	printf("  -d  Day/night cycle with a day of SECONDS (e.g. %d)\n",DAY_LENGTH);
+	printf("  -w  2D water DEPTH rows into the screen (e.g. 32) instead of 1D columns\n");
+	printf("  -x  Deterministic fixed point physics for the 1D water, drips and cloud (not with -w)\n");
+	printf("  -X  Cross-check fixed point against float physics for FRAMES frames and exit\n");
+	printf("  -z  Resize the world at random for FRAMES frames, checking its state, and exit (make ASAN=1)\n");
+	printf("  -c  Color mode (default from COLORTERM and TERM, or what the terminal answers)\n");
+	printf("  -a  ASCII glyphs only\n");
+	printf("  -r  Pan sideways by scrolling columns (SL/SR, e.g. xterm), or set scroll_columns=1 in the cache\n");
+	printf("  -u  Show each frame at once with synchronized output (DECSET 2026)\n");
+	printf("  -p  Probe the terminal again rather than use what was cached for TERM\n");
+	printf("      (color mode and synchronized output are probed once per TERM)\n");
+	printf("  -B  Hold output under BYTES per second, lowering the frame rate, then colors and detail\n");
+	printf("  -s  Show output rate and stage timings on the top line (make STATS=1)\n");
+	printf("  -S  Write stage timings to FILE on SIGUSR1 (default island.stats, make STATS=1)\n");
+	printf("  -b  Benchmark output bytes and encoder throughput offscreen and exit\n");
+	printf("  -g  World size, wider than the terminal to follow the cloud across it, or\n");
+	printf("      offscreen size for -b (default 200x60) and world size for -L and -M (default 80x24)\n");
+	printf("  -L  Serve one world to every viewer that connects to SOCKET\n");
+	printf("  -C  View the world served on SOCKET\n");
+	printf("  -M  Publish the world in shared memory NAME (e.g. /island) for viewers on this host\n");
+	printf("  -V  View the world published in shared memory NAME\n");
+	printf("  -R  Write video frames to stdout instead of drawing, raw RGB24 or Y4M (4:2:0)\n");
+	printf("      of %dx%d pixel cells, e.g. -R y4m | ffmpeg -i - rain.mp4 (default world %dx%d)\n",
+		RASTER_CW,RASTER_CH,RASTER_WIDTH,RASTER_HEIGHT);
+	printf("  -N  Stop -R after FRAMES frames (default when the output is closed)\n");
+	printf("Keys: q quit, space pause, h/l or arrows steer the cloud, +/- rain harder or softer,\n");
+	printf("      0 rain as configured, </> pan, f follow the cloud, click to drop a drip or splash\n");
+}
+
+
+#ifdef STATS
+uint64_t stats_now() {
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+void stats_record(size_t stage, uint64_t ns) {
+	size_t bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	uint64_t recent = __atomic_load_n(&stats.recent[stage],__ATOMIC_RELAXED);
+	
+	bucket = bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS-1;
+	__atomic_fetch_add(&stats.count[stage],1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats.total[stage],ns,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats.hist[stage][bucket],1,__ATOMIC_RELAXED);
+	if( ns > __atomic_load_n(&stats.max[stage],__ATOMIC_RELAXED) ) {
+		__atomic_store_n(&stats.max[stage],ns,__ATOMIC_RELAXED);
 	}
+	__atomic_store_n(&stats.recent[stage],recent - recent/16 + ns/16,__ATOMIC_RELAXED);
+}
+
+
+//Write the counters to path in this format, one stage per line:
+//  island-stats 2
+//  frames N
+//  output bytes N frames N dropped N frame_bytes N frame_max N per_second N budget N level N
+//  STAGE count N total_ns N max_ns N hist B0 .. B31
+int stats_dump(const char *path, governor_t *gov) {
+	char buf[256 + 8*21 + STAGES*(64 + 3*21 + STATS_BUCKETS*21)];
+	size_t output[8];
+	char *names[8] = {"bytes", "frames", "dropped", "frame_bytes", "frame_max", "per_second", "budget", "level"};
+	outbuf_t out;
+	size_t i,b;
+	int fd;
+	int err;
 	
-	cloud->drop_count++;
-	if( cloud->drop_count >= cloud->drop_delay ) {
-		cloud->drop_count = 0;
-		drips_generate(drips,(int)(cloud->pos/8.0)+2);
+	out.data = buf;
+	out.len = 0;
+	out.size = sizeof(buf);
+	out_str(&out,"island-stats 2\nframes ");
+	out_num(&out,__atomic_load_n(&stats.frames,__ATOMIC_RELAXED));
+	out_str(&out,"\noutput");
+	output[0] = gov->bytes;
+	output[1] = gov->frames;
+	output[2] = gov->dropped;
+	output[3] = gov->frame_bytes;
+	output[4] = gov->frame_max;
+	output[5] = gov->second_bytes;
+	output[6] = gov->budget;
+	output[7] = gov->level;
+	for( i=0; i<8; i++ ) {
+		out_str(&out," ");
+		out_str(&out,names[i]);
+		out_str(&out," ");
+		out_num(&out,output[i]);
+	}
+	out_str(&out,"\n");
+	for( i=0; i<STAGES; i++ ) {
+		out_str(&out,stage_names[i]);
+		out_str(&out," count ");
+		out_num(&out,__atomic_load_n(&stats.count[i],__ATOMIC_RELAXED));
+		out_str(&out," total_ns ");
+		out_num(&out,__atomic_load_n(&stats.total[i],__ATOMIC_RELAXED));
+		out_str(&out," max_ns ");
+		out_num(&out,__atomic_load_n(&stats.max[i],__ATOMIC_RELAXED));
+		out_str(&out," hist");
+		for( b=0; b<STATS_BUCKETS; b++ ) {
+			out_str(&out," ");
+			out_num(&out,__atomic_load_n(&stats.hist[i][b],__ATOMIC_RELAXED));
+		}
+		out_str(&out,"\n");
+	}
+	fd = open(path,O_WRONLY|O_CREAT|O_TRUNC,0644);
+	if( fd < 0 ) {
+		return -1;
+	}
+	err = outbuf_flush(&out,fd);
+	close(fd);
+	return err ? -2 : 0;
+}
+
+
+void stats_signal(int sig) {
+	(void)sig;
+	stats_dump_request = 1;
+}
+
+
+//One line of recent stage times in microseconds, for the encoder to draw
+//over the top of the frame
+void stats_overlay(screen_t *screen, governor_t *gov) {
+	char *line = screen->status;
+	size_t len;
+	size_t i;
+	int n;
+	
+	n = snprintf(line,sizeof(screen->status),"B/s %zu level %zu ",gov->second_bytes,gov->level);
+	len = n > 0 ? n : 0;
+	for( i=0; i<STAGES && len<sizeof(screen->status); i++ ) {
+		n = snprintf(line+len,sizeof(screen->status)-len,"%s %.1f ",stage_names[i],
+			__atomic_load_n(&stats.recent[i],__ATOMIC_RELAXED)/1000.0);
+		len = n > 0 ? len+n : len;
 	}
+	screen->status_len = len < sizeof(screen->status) ? len : sizeof(screen->status)-1;
+}
+
+
+//Cost of timing one stage against the frame budget
+int bench_stats() {
+	size_t i;
+	size_t n = 1000000;
+	uint64_t start;
+	double each;
 	
+	start = stats_now();
+	for( i=0; i<n; i++ ) {
+		STAGE(STAGE_TERMSIZE,(void)0);
+	}
+	each = (double)(stats_now()-start)/n;
+	printf("stats: %.1f ns per timed stage, %.4f%% of a %g fps frame for %d stages\n",
+		each,each*STAGES*params_current()->frame_rate/1e7,params_current()->frame_rate,STAGES);
+	memset(&stats,0,sizeof(stats));
 	return 0;
 }
+#endif
 
 
-int main() {
+int main(int argc, char **argv) {
 	termsize_t term;
+	termsize_t world;
+	camera_t camera;
 	drips_t drips;
 	cloud_t cloud;
 	water_t water;
+	palette_t palette;
+	screen_t screen;
+	storm_t storm;
+	daynight_t day;
+	pacer_t pacer;
+	governor_t gov;
+	input_t input;
+	caps_t caps;
+	size_t budget = 0;
+	double day_length = 0;
+	size_t wave_depth = 0;
+	size_t check_frames = 0;
+	size_t fuzz_frames = 0;
+	uint8_t fixed = 0;
+	uint8_t lightning = 0;
+	uint8_t osc = 0;
+	uint8_t bench = 0;
+	uint8_t ascii = 0;
+	uint8_t scroll_columns = 0;
+	uint8_t sync = 0;
+	uint8_t reprobe = 0;
+	char *raster = 0;
+	size_t raster_frames = 0;
+	char *scene_path = 0;
+	uint8_t colored = 0;
+	uint8_t changed;
+	uint8_t pending = 0;
+	uint8_t mode;
+	size_t step;
+	size_t bench_width = 200;
+	size_t bench_height = 60;
+	char *config = 0;
+	char *serve = 0;
+	char *connect_path = 0;
+	char *publish = 0;
+	char *shm_view = 0;
+	uint8_t sized = 0;
+	char *stats_path = "island.stats";
+	uint8_t overlay = 0;
+	int opt;
+	int err;
+	
+	mode = color_mode_detect();
+	scene_init(&scene);
+	while( (opt = getopt(argc,argv,"f:e:lod:w:xX:z:c:arupB:sS:bg:L:C:M:V:R:N:h")) != -1 ) {
+		switch( opt ) {
+			case 'f':
+				config = optarg;
+				break;
+			case 'l':
+				lightning = 1;
+				break;
+			case 'o':
+				osc = 1;
+				break;
+			case 'd':
+				day_length = atof(optarg);
+				break;
+			case 'w':
+				wave_depth = atoi(optarg);
+				break;
+			case 'x':
+				fixed = 1;
+				break;
+			case 'R':
+				if( strcmp(optarg,"rgb") && strcmp(optarg,"y4m") ) {
+					usage(argv[0]);
+					return 1;
+				}
+				raster = optarg;
+				break;
+			case 'N':
+				raster_frames = atoi(optarg);
+				break;
+			case 'e':
+				scene_path = optarg;
+				break;
+			case 'X':
+				check_frames = atoi(optarg);
+				if( !check_frames ) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'z':
+				fuzz_frames = atoi(optarg);
+				if( !fuzz_frames ) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'c':
+				if( !strcmp(optarg,"16") ) {
+					mode = COLORS_16;
+				}
+				else if( !strcmp(optarg,"256") ) {
+					mode = COLORS_256;
+				}
+				else if( !strcmp(optarg,"true") ) {
+					mode = COLORS_TRUE;
+				}
+				else {
+					usage(argv[0]);
+					return 1;
+				}
+				colored = 1;
+				break;
+			case 'a':
+				ascii = 1;
+				break;
+			case 'r':
+				scroll_columns = 1;
+				break;
+			case 'u':
+				sync = 1;
+				break;
+			case 'p':
+				reprobe = 1;
+				break;
+			case 'B':
+				budget = strtoul(optarg,0,10);
+				break;
+			case 's':
+				overlay = 1;
+				break;
+			case 'S':
+				stats_path = optarg;
+				break;
+			case 'b':
+				bench = 1;
+				break;
+			case 'g':
+				if( sscanf(optarg,"%zux%zu",&bench_width,&bench_height) != 2 ||
+						!bench_width || !bench_height ) {
+					usage(argv[0]);
+					return 1;
+				}
+				sized = 1;
+				break;
+			case 'L':
+				serve = optarg;
+				break;
+			case 'C':
+				connect_path = optarg;
+				break;
+			case 'M':
+				publish = optarg;
+				break;
+			case 'V':
+				shm_view = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	
+	//The 2D water steps in float from the surface speeds alone, so fixed
+	//point drips would land in it without a splash
+	if( fixed && wave_depth ) {
+		printf("-x is for the 1D water and cannot be used with -w\n");
+		usage(argv[0]);
+		return 1;
+	}
+#ifndef STATS
+	if( overlay || strcmp(stats_path,"island.stats") ) {
+		printf("Stage timing is not built in, rebuild with make STATS=1\n");
+		return 1;
+	}
+#endif
+	//The scene's parameters are the defaults -f starts from
+	if( scene_path && scene_load(&scene,scene_path) ) {
+		if( scene.line ) {
+			printf("Failed to load scene %s at line %zu\n",scene_path,scene.line);
+		}
+		else {
+			printf("Failed to read scene %s\n",scene_path);
+		}
+		return 1;
+	}
+	lightning = lightning | !!(scene.systems & SCENE_STORM);
+	day_length = day_length ? day_length : scene.day;
+	params_init(&params_slots[0]);
+	if( config && params_load(&params_slots[0],config) ) {
+		printf("Failed to load parameters from %s\n",config);
+		return 1;
+	}
+	glyphs_init();
+	colors_init();
+	if( check_frames ) {
+		return check_fixed(bench_width,bench_height,check_frames) ? 1 : 0;
+	}
+	if( fuzz_frames ) {
+		return fuzz_resize(fuzz_frames) ? 1 : 0;
+	}
+	if( bench ) {
+		if( bench_flash(bench_width,bench_height,100,mode) || 
+				bench_encode(bench_width,bench_height,1000) ||
+				bench_daynight(bench_width,bench_height,mode) ||
+				bench_pan(bench_width,bench_height,mode) ||
+				bench_governor(bench_width,bench_height,0) ||
+				bench_governor(bench_width,bench_height,4000) ||
+				bench_governor(bench_width,bench_height,1000) ||
+				bench_water(bench_width,bench_height,6000) ||
+				bench_water(bench_width*10,bench_height,6000) ||
+				bench_wave(400,120,1000) ||
+				bench_shm(bench_width,bench_height,1000) ||
+				bench_raster(RASTER_WIDTH,RASTER_HEIGHT,1000) ||
+				bench_scene("scenes/lagoon.scene",bench_width,bench_height,1000) ||
+				bench_sprites(bench_width,bench_height,500,1000) ) {
+			printf("Benchmark failed\n");
+			return 1;
+		}
+#ifdef STATS
+		bench_stats();
+#endif
+		return 0;
+	}
+	
+	//The environment's color mode holds unless the terminal says it has
+	//more, and -c holds over both
+	if( !serve && !publish && !raster ) {
+		caps_init(&caps,reprobe);
+		if( !colored && caps.colors > mode ) {
+			mode = caps.colors;
+		}
+		sync = sync | caps.sync;
+		scroll_columns = scroll_columns | caps.scroll_columns;
+	}
+	if( connect_path ) {
+		err = client_run(connect_path,mode,ascii ? GLYPHS_ASCII : GLYPHS_UNICODE);
+		if( err ) {
+			printf("Failed to view %s\n",connect_path);
+		}
+		return err ? 1 : 0;
+	}
+	if( shm_view ) {
+		err = shm_view_run(shm_view,mode,ascii ? GLYPHS_ASCII : GLYPHS_UNICODE);
+		if( err ) {
+			printf("Failed to view %s\n",shm_view);
+		}
+		return err ? 1 : 0;
+	}
 	
 	srandom(time(0));
 	
-	if( termsize_init(&term) ) {
+	if( !serve && !publish && !raster && termsize_init(&term) ) {
 		printf("Failed to intialize term\n");
 		return 1;
 	}
-	if( drips_init(&drips,&term) ) {
+	//A world sized with -g keeps its size and the terminal looks at part of
+	//it, otherwise the world is the terminal.  A served or headless world
+	//has no terminal of its own.
+	if( sized || serve || publish || raster ) {
+		world.width = sized ? bench_width : raster ? RASTER_WIDTH : 80;
+		world.height = sized ? bench_height : raster ? RASTER_HEIGHT : 24;
+		world.updated = 1;
+	}
+	else {
+		world = term;
+	}
+	if( drips_init(&drips,&world) ) {
 		printf("Failed to initialize drips\n");
 		return 1;
 	}
-	if( cloud_init(&cloud,&term) ) {
+	if( cloud_init(&cloud,&world) ) {
 		printf("Failed to initialize cloud\n");
 		return 1;
 	}
-	if( water_init(&water,&term) ) {
+	if( water_init(&water,&world,wave_depth) ) {
 		printf("Failed to initialize water\n");
 		return 1;
 	}
+	if( palette_init(&palette) ) {
+		printf("Failed to initialize palette\n");
+		return 1;
+	}
+	if( screen_init(&screen,serve || publish || raster ? &world : &term,&palette) ) {
+		printf("Failed to initialize screen\n");
+		return 1;
+	}
+	screen_set_color_mode(&screen,mode);
+	screen_set_glyphs(&screen,ascii ? GLYPHS_ASCII : GLYPHS_UNICODE);
+	governor_init(&gov,budget,&screen);
+	water.fixed = fixed;
+	drips.fixed = fixed;
+	cloud.fixed = fixed;
+	storm_init(&storm,lightning);
+	daynight_init(&day,&palette,day_length);
+	screen.osc_palette = osc;
+	screen.scroll_columns = scroll_columns;
+	screen.sync = sync;
+	pacer_init(&pacer);
+	camera_init(&camera);
+#ifdef STATS
+	signal(SIGUSR1,stats_signal);
+#endif
+	if( config ) {
+		signal(SIGHUP,params_hangup);
+	}
+	if( serve ) {
+		server_run(serve,config,&world,&drips,&cloud,&water,&day,&storm,&palette);
+		printf("Failed to serve on %s\n",serve);
+		return 1;
+	}
+	if( publish ) {
+		if( shm_publish_run(publish,config,&world,&drips,&cloud,&water,&day,&storm,&screen) ) {
+			printf("Failed to publish %s\n",publish);
+			return 1;
+		}
+		return 0;
+	}
+	if( raster ) {
+		if( raster_run(strcmp(raster,"y4m") ? RASTER_RGB : RASTER_Y4M,raster_frames,config,&world,&drips,
+				&cloud,&water,&day,&storm,&screen) ) {
+			printf("Failed to render frames\n");
+			return 1;
+		}
+		return 0;
+	}
+	if( input_init(&input) ) {
+		printf("Failed to set up the terminal for input\n");
+		return 1;
+	}
+	input.osc_palette = screen.osc_palette;
 	for(;;) {
-		termsize_update(&term);
-		drips_update(&drips,&water);
-		cloud_update(&cloud,&drips);
-		water_update(&water);
-		printf("\x1b[2J\x1b[H");
-		render(&water,&drips,&cloud);
-		printf("\x1b[0m");
-		fflush(0);
-		usleep(100000);
+		input_update(&input,&screen,&drips,&cloud,&water,&camera);
+		if( input.quit ) {
+			input_restore(&input);
+			return 0;
+		}
+		//The alternate screen was left while stopped
+		if( input_resumed ) {
+			input_resumed = 0;
+			screen.invalid = 1;
+		}
+		//A bad file keeps the parameters already in use
+		if( params_reload ) {
+			params_reload = 0;
+			if( config ) {
+				params_swap(config);
+			}
+		}
+		//What input did is drawn even when the step clears the flag for it,
+		//as drips_update does for a clicked drip
+		changed = screen.invalid | pending | input.acted;
+		input.acted = 0;
+		for( step=0; step<pacer.steps; step++ ) {
+			STAGE(STAGE_TERMSIZE,termsize_update(&term));
+			if( !sized ) {
+				world = term;
+			}
+			STAGE(STAGE_SCREEN,screen_update(&screen));
+			//Paused, the view still follows the terminal and the keys
+			if( !input.paused ) {
+				STAGE(STAGE_DRIPS,drips_update(&drips,&water));
+				STAGE(STAGE_CLOUD,cloud_update(&cloud,&drips));
+				STAGE(STAGE_WATER,water_update(&water));
+				STAGE(STAGE_DAYNIGHT,daynight_update(&day));
+				STAGE(STAGE_STORM,storm_update(&storm,&screen));
+				changed = changed | drips.updated | cloud.updated | water.updated | day.updated | 
+					storm.updated;
+			}
+			else {
+				//A drip clicked in while paused waits where it was dropped
+				changed = changed | drips.updated;
+				drips.updated = 0;
+			}
+			camera_update(&camera,&screen,&world,&cloud);
+			changed = changed | term.updated | world.updated | camera.updated;
+			world.updated = 0;
+		}
+		//Nothing that moved can be seen, so there is nothing to compose or
+		//write.  A frame held back for the budget is drawn once it allows.
+		pending = changed && !governor_allow(&gov);
+		if( changed && !pending ) {
+			STAGE(STAGE_RENDER,render(&water,&drips,&cloud,&screen));
+#ifdef STATS
+			if( overlay ) {
+				stats_overlay(&screen,&gov);
+			}
+#endif
+			STAGE(STAGE_ENCODE,screen_encode(&screen));
+		}
+		pacer_update(&pacer,screen.out.len > 0);
+		governor_update(&gov,&screen,screen.out.len,step);
+		//With SIGHUP caught, a terminal that went away shows up here
+		STAGE(STAGE_FLUSH,err = outbuf_flush(&screen.out,STDOUT_FILENO));
+		if( err ) {
+			input_restore(&input);
+			return 1;
+		}
+#ifdef STATS
+		stats.frames++;
+		if( stats_dump_request ) {
+			stats_dump_request = 0;
+			stats_dump(stats_path,&gov);
+		}
+#endif
+		//Keys are handled as they arrive, but the world only steps again
+		//once the frame is due
+		input_due(&input,params_current()->frame_delay*pacer.steps);
+		while( !input.quit && input_wait(&input) > 0 ) {
+			input_update(&input,&screen,&drips,&cloud,&water,&camera);
+			//Input shows within a frame, however far the pacer backed off
+			if( input.acted ) {
+				pacer_init(&pacer);
+				input_hurry(&input,params_current()->frame_delay);
+			}
+		}
 	}
 	return 0;
-}
\ No newline at end of file
+}